@@ -4,12 +4,42 @@
 
 #include <sys/mman.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <errno.h>
 
 #define NDEBUG
 
 #include <assert.h>
 
+//USDT probes for tracing with perf or bpftrace. They are compiled in
+//whenever <sys/sdt.h> is there, unless WMALLOC_NO_PROBES is defined,
+//and are a single nop each until a tracer attaches.
+#if !defined(WMALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WMALLOC_PROBES
+#endif
+#endif
+
+#ifdef WMALLOC_PROBES
+#define WMALLOC_PROBE1(name, a) DTRACE_PROBE1(wmalloc, name, a)
+#define WMALLOC_PROBE2(name, a, b) DTRACE_PROBE2(wmalloc, name, a, b)
+#define WMALLOC_PROBE3(name, a, b, c) DTRACE_PROBE3(wmalloc, name, a, b, c)
+#else
+//the arguments are still evaluated so nothing is left unused
+#define WMALLOC_PROBE1(name, a) do{ (void)(a); }while(0)
+#define WMALLOC_PROBE2(name, a, b) do{ (void)(a); (void)(b); }while(0)
+#define WMALLOC_PROBE3(name, a, b, c) do{ (void)(a); (void)(b); (void)(c); }while(0)
+#endif
+
 
 /*
   wmalloc:
@@ -126,6 +156,275 @@
   For example:   int* array = wmalloc(sizeof(int)*1000);
                  wfree(array);
 
+  Free memory can be handed back to the OS with wmalloc_trim. At most
+  'pad' bytes of free memory are kept resident. The number of bytes
+  released is returned.
+
+  For example:   uint64_t released = wmalloc_trim(0);
+
+  A background thread can take the consolidating of freed chunks and
+  the purging of idle free pages off the wfree path. Every interval
+  it consolidates the deferred frees, releases the free pages that
+  have been idle for about 'decay_ms' and unmaps empty regions.
+  Link with -pthread.
+
+  For example:   wmalloc_background_start(10, 1000);
+                 ...
+                 wmalloc_background_stop();
+
+  The same thread can keep a reserve of regions mapped ahead of time
+  so wmalloc does not call mmap when the bins run dry. It maps more
+  whenever fewer than 'low' are left, up to 'high'. The regions can
+  be faulted in up front with WMALLOC_PREMAP_POPULATE.
+
+  For example:   wmalloc_premap_start(4, 16, WMALLOC_PREMAP_POPULATE);
+
+  The placement policy decides which available chunk a request takes:
+  WMALLOC_BEST_FIT (the default), WMALLOC_FIRST_FIT (address ordered),
+  WMALLOC_NEXT_FIT, WMALLOC_LIFO or WMALLOC_SEGREGATED (small chunks
+  in an address range of their own). Set it at compile time with
+  -DWMALLOC_POLICY=... or at run time. wmalloc_test.c benchmarks each.
+
+  For example:   wmalloc_set_policy(WMALLOC_FIRST_FIT);
+
+  Settings can be changed at startup without recompiling through the
+  WMALLOC_CONF environment variable, a comma separated list of
+  key:value pairs. The keys are region_size, mmap_threshold,
+  background_ms, decay_ms, reserve_low, reserve_high, populate, policy,
+  size_classes and learn_window. See read_config in wmalloc.h.
+
+  For example:   WMALLOC_CONF="region_size:1m,policy:first_fit" ./prog
+
+  The bins can be fitted to the sizes a program actually asks for.
+  wmalloc counts the sizes of the next 'window' requests and then adds
+  a bin for each size that is requested often. The report gives the
+  average bytes between a request and the top of its bin before and
+  after.
+
+  For example:   wmalloc_learn_size_classes(10000);
+                 ...
+                 struct wmalloc_size_class_report report;
+                 wmalloc_size_class_report(&report);
+
+  Memory can be kept apart in heaps of its own. Each heap has its own
+  bins and regions and heap_destroy unmaps all of them in one go,
+  whatever is still allocated. wmalloc and wfree use the default heap.
+
+  For example:   wmalloc_heap_t heap = heap_create();
+                 char* name = heap_alloc(heap, 64);
+                 ...
+                 heap_free(heap, name);
+                 heap_destroy(heap);
+
+  A heap can also live in a file and be opened again later with its
+  contents and bins as they were. The links inside the heap are kept
+  as offsets, so reopening maps the file and is done. Links between
+  your own objects should be stored with heap_offset too.
+
+  For example:   wmalloc_heap_t heap = wmalloc_pheap_open("index.heap");
+                 struct index* index = wmalloc_pheap_root(heap);
+                 if(index == NULL){
+                   index = heap_alloc(heap, sizeof(struct index));
+                   wmalloc_pheap_set_root(heap, index);
+                 }
+                 ...
+                 wmalloc_pheap_close(heap);
+
+  A heap can be shared between processes. With a name it is a POSIX
+  shared memory object that other processes attach to. Without a name
+  it is shared with the children forked afterwards. Any process can
+  allocate a buffer and hand its heap_offset to another, which turns
+  it back into a pointer with heap_pointer. Nothing is copied.
+
+  For example:   wmalloc_heap_t heap = wmalloc_shared_create("/buffers", 1 << 30);
+                 char* buffer = heap_alloc(heap, 65536);
+                 send_to_worker(heap_offset(heap, buffer));
+
+                 in the worker:
+                 wmalloc_heap_t heap = wmalloc_shared_attach("/buffers");
+                 char* buffer = heap_pointer(heap, offset);
+                 ...
+                 heap_free(heap, buffer);
+
+  When <sys/sdt.h> is available wmalloc has USDT probes under the
+  provider "wmalloc" that perf and bpftrace can attach to in a running
+  program: wmalloc_entry, wmalloc_return, wfree, bin_miss,
+  allocate_chunk, split_chunk and join_chunks. They take the heap or
+  chunk and the sizes involved as arguments and cost a nop when
+  nothing is attached. Define WMALLOC_NO_PROBES to leave them out.
+
+  For example:   bpftrace -e 'usdt:./prog:wmalloc:bin_miss { @[arg2] = count(); }'
+
+  The counters of the default heap can be watched from outside with
+  wmstat. Start the program with WMALLOC_CONF="stats:1" and run
+  wmstat with its pid. It prints the bytes mapped and in use and the
+  allocation, free, bin miss and new region rates every interval,
+  like vmstat. With -b it prints the available chunks per bin.
+
+  For example:   WMALLOC_CONF="stats:1" ./prog &
+                 wmstat $! 1000
+
+  Accounting or sampling of your own can be plugged in with
+  wmalloc_set_hooks. Fill a struct wmalloc_hooks with the functions to
+  call before and after an allocation, before a free and when a
+  region is mapped or unmapped, and a pointer to pass them. Without
+  hooks wmalloc and wfree only test a flag. The hooks must not
+  allocate from the heap that calls them and the region hooks can be
+  called with its lock held.
+
+  For example:   struct wmalloc_hooks hooks = { .post_alloc = sample, .arg = &profile };
+                 wmalloc_set_hooks(&hooks);
+
+  Memory can be attributed to parts of a program with
+  wmalloc_tagged, which allocates like wmalloc and counts the chunk
+  towards a tag from 1 to 255 until it is freed. The tag is kept in
+  the chunk header. wmalloc_tag_usage returns the bytes a tag holds,
+  counted per thread so wmalloc and wfree do not share a counter.
+  With wmalloc_tag_limit a tag gets a soft limit and wmalloc_tagged
+  returns NULL right away for a request that would go over it. The
+  first call shares the default heap between threads, so make it
+  before the other threads are started.
+
+  For example:   #define CACHE_TAG 1
+                 wmalloc_tag_limit(CACHE_TAG, 64 << 20);
+                 entry = wmalloc_tagged(size, CACHE_TAG);
+
+  wmalloc_dump_heap writes a snapshot of the layout of the heap, and
+  of each NUMA arena after it, to a file descriptor: every region and
+  the size, state and tag of each of its chunks, in a compact binary
+  format. wmheap reads it and prints a summary for each heap, a
+  histogram of the sizes of the available chunks and with -m a map of
+  each region showing where the free space is. heap_dump does the same
+  for a heap of its own.
+
+  For example:   int fd = open("heap.dump", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+                 wmalloc_dump_heap(fd);
+                 ...
+                 wmheap -m heap.dump
+
+  On machines with several NUMA nodes wmalloc_numa_arenas gives each
+  node arenas of its own. A thread allocates from an arena of the
+  node it runs on, whose memory is bound to that node, and wfree
+  returns a chunk to the arena it came from. Set arenas in
+  WMALLOC_CONF to turn them on at startup. More arenas than nodes are
+  shared out by CPU, which also works on a single node. Large buffers
+  every node reads can be spread over all nodes with
+  wmalloc_interleaved.
+
+  For example:   wmalloc_numa_arenas(0);
+                 table = wmalloc_interleaved(1 << 30);
+
+  wfree_bulk frees an array of pointers, taking the lock once for a
+  batch of them. For lock free structures wmalloc has epoch based
+  reclamation: readers bracket their accesses with
+  wmalloc_epoch_enter and wmalloc_epoch_exit, and a node taken out of
+  the structure is handed to wmalloc_retire instead of wfree. It is
+  freed in bulk, together with the others the thread retired, once
+  every thread has left the critical sections it could have been seen
+  in. wmalloc_retire_flush frees what it can before the program ends.
+  The first call shares the default heap between threads, so make it
+  before the other threads are started.
+
+  For example:   wmalloc_epoch_enter();
+                 node = pop(&stack);
+                 wmalloc_epoch_exit();
+                 wmalloc_retire(node);
+
+  Temporary buffers can come from the scratch space of a thread
+  instead. wmalloc_scratch_alloc bumps a pointer in a 64KB block taken
+  from wmalloc, and nothing is freed on its own: wmalloc_scratch_mark
+  notes where the space is up to and wmalloc_scratch_release gives
+  back everything allocated since. Released blocks are kept for the
+  next calls.
+
+  For example:   void* mark = wmalloc_scratch_mark();
+                 char* path = wmalloc_scratch_alloc(4096);
+                 ...
+                 wmalloc_scratch_release(mark);
+
+  A process that must not make system calls once it runs can give
+  wmalloc its memory up front with wmalloc_init_with_buffer, before
+  the first wmalloc. wmalloc and wfree then work within the buffer
+  and never call mmap. When it is used up wmalloc returns NULL and
+  sets errno to ENOMEM.
+
+  For example:   void* buffer = mmap(NULL, 1 << 30, PROT_READ|PROT_WRITE,
+                                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_LOCKED, -1, 0);
+                 wmalloc_init_with_buffer(buffer, 1 << 30);
+
+  To keep the first burst of requests after startup from paying for
+  mmap and page faults, wmalloc_reserve maps memory ahead and puts it
+  in the bins. With WMALLOC_RESERVE_POPULATE the pages are faulted in
+  by mmap, with WMALLOC_RESERVE_TOUCH by writing to them and with
+  WMALLOC_RESERVE_LOCK they are locked. heap_reserve does the same for
+  a heap of its own.
+
+  For example:   wmalloc_reserve(256 << 20, WMALLOC_RESERVE_POPULATE|WMALLOC_RESERVE_LOCK);
+
+  In a container the background thread can watch how close the cgroup
+  is to its memory limit and how much time tasks stall on memory
+  (PSI). As the pressure rises it purges free pages and unmaps empty
+  regions sooner, and at full pressure it releases everything it can,
+  including the reserve. wmalloc_memory_pressure returns the pressure
+  it last saw, from 0 to 100. Also set with WMALLOC_CONF="pressure:1".
+
+  For example:   wmalloc_pressure_watch(NULL);
+
+  A program that defragments by copying its objects can ask
+  wmalloc_defrag_hint whether moving one is worth it. It returns 1
+  when the object sits in a sparsely used region and a new chunk of
+  its size would land in a region that is used more densely. Once a
+  region has been emptied wmalloc_trim gives it back. The bytes in
+  use in a region are added up once per scan, so start each pass
+  over the objects with wmalloc_defrag_scan.
+
+  For example:   wmalloc_defrag_scan();
+                 if(wmalloc_defrag_hint(obj) == 1){
+                   void* moved = wmalloc(size);
+                   memcpy(moved, obj, size);
+                   wfree(obj);
+                   obj = moved;
+                 }
+
+  Long lived memory can be reached through a handle instead of a
+  pointer, at the price of pinning it to get its address. Unpinned
+  handle allocations are slid together by wmalloc_compact, which then
+  gives the space freed at the end of each region back to the OS.
+
+  For example:   wm_handle h = wmalloc_h(100);
+                 char* p = wmalloc_pin(h);
+                 ...
+                 wmalloc_unpin(h);
+                 wmalloc_compact();
+                 wfree_h(h);
+
+  For pointer heavy data a heap can live in a cage of 4GB of address
+  space, so that references into it fit in 32 bits. wmalloc_compress
+  turns a pointer into the cage into a 32 bit reference and
+  wmalloc_decompress turns it back. wmalloc_init_cage runs wmalloc and
+  wfree themselves in a cage.
+
+  For example:   wmalloc_heap_t cage = wmalloc_cage_create();
+                 uint32_t ref = wmalloc_compress(cage, heap_alloc(cage, 32));
+                 heap_free(cage, wmalloc_decompress(cage, ref));
+
+  Compiled with -DWMALLOC_COMPACT the links between available chunks
+  are 32 bit offsets, which brings the smallest chunk down from 40 to
+  32 bytes. The default heap and every heap_create heap then lie in a
+  cage, and premapping, arenas and the stats segment are not
+  available.
+
+  For example:   $gcc -std=gnu99 -DWMALLOC_COMPACT example.c -o example
+
+  Each new region starts a cache line further into its first page,
+  over 16 cache lines, so that the objects at the start of regions
+  laid out alike do not all fall into the same cache sets. The
+  colours key of WMALLOC_CONF changes the number of colours, 0 turns
+  colouring off. Regions of a span heap or cage and regions of their
+  own for big requests are not coloured.
+
+  For example:   $WMALLOC_CONF="colours:0" ./example
+
 ----------------------------------------------------------------------
 
   A reference that was found helpful in the design
@@ -134,22 +433,243 @@
 
 
 #define CHUNK_OVERHEAD 24
-#define NUM_BINS 46
+
+//the most bins a size class layout can have
+#define NUM_BINS 128
 
 //the mimimum size that MMAP will request (32 pages of 4096 bytes)
+//Can be changed at startup with region_size in WMALLOC_CONF
 #define MMAP_SIZE 0x20000
 
 //Page Size
 #define PAGE_SIZE 0x1000
 
-#define MINIMUM_CHUNK_SIZE 40
+//the start of each region is moved on by a cache line at a time over
+//this many colours, see region_colour. colours in WMALLOC_CONF.
+#define CACHE_LINE 64
+#define WMALLOC_COLOURS 16
 
+//with WMALLOC_COMPACT the links of an available chunk take 4 bytes
+//each instead of 8, see struct chunk
+#ifdef WMALLOC_COMPACT
+#define MINIMUM_CHUNK_SIZE 32
+#else
+#define MINIMUM_CHUNK_SIZE 40
+#endif
+
+//upper bit of a size tag: the neighbor the tag describes is in use
+#define IN_USE_FLAG 0x8000000000000000
+
+//set in the size at the end of an available chunk once its pages
+//have been handed back to the OS
+#define PURGED_FLAG 0x4000000000000000
+
+//the bits of a size tag that hold the size itself
+#define SIZE_MASK 0x0000ffffffffffff
+
+//a chunk in use keeps the tag it was allocated with in these bits of
+//its prev_chunk_size, see wmalloc_tagged
+#define TAG_SHIFT 48
+#define TAG_MASK 0x00ff000000000000
+#define WMALLOC_TAGS 256
+
+//number of deferred frees consolidated per hold of the lock
+#define DEFERRED_BATCH 64
+
+//flags for wmalloc_premap_start
+#define WMALLOC_PREMAP_POPULATE 0x1
+
+//flags for wmalloc_reserve
+#define WMALLOC_RESERVE_POPULATE WMALLOC_PREMAP_POPULATE
+#define WMALLOC_RESERVE_TOUCH 0x2
+#define WMALLOC_RESERVE_LOCK 0x4
+
+//map_region flag to colour the region, see region_colour
+#define MAP_COLOUR 0x8
+
+//memory pressure, see wmalloc_pressure_watch. Percent of the cgroup
+//limit in use where pressure starts and where it is full
+#define WMALLOC_PRESSURE_USAGE_LOW 70
+#define WMALLOC_PRESSURE_USAGE_HIGH 95
+//percent of time stalled on memory that is full pressure
+#define WMALLOC_PRESSURE_STALL_HIGH 10.0
+//interval of the background thread if the watch starts it
+#define WMALLOC_PRESSURE_INTERVAL 1000
+#define PRESSURE_PATH_LENGTH 512
+
+//regions with less than this percent of their bytes in use are worth
+//emptying, see wmalloc_defrag_hint
+#define WMALLOC_DEFRAG_SPARSE 50
+//regions in the first defrag index, it doubles when they run out
+#define DEFRAG_INDEX_START 256
+//the bytes in use of a region the scan has not looked at yet
+#define DEFRAG_UNMEASURED 0xffffffffffffffff
+
+//handles in the first table, it doubles when they run out
+#define HANDLES_START 1024
+//bytes in front of a handle allocation, see wmalloc_h for how it
+//stays 16 byte aligned
+#define HANDLE_HEADER 16
+
+//placement policies, see wmalloc_set_policy
+#define WMALLOC_BEST_FIT 0
+#define WMALLOC_FIRST_FIT 1
+#define WMALLOC_NEXT_FIT 2
+#define WMALLOC_LIFO 3
+#define WMALLOC_SEGREGATED 4
+
+//the policy wmalloc starts with
+#ifndef WMALLOC_POLICY
+#define WMALLOC_POLICY WMALLOC_BEST_FIT
+#endif
+
+//with WMALLOC_SEGREGATED chunks up to this size come from regions in
+//an address range of their own, sized SMALL_SPACE_SIZE
+#define SMALL_CHUNK_LIMIT 1024
+#define SMALL_SPACE_SIZE 0x1000000000
+
+//while learning size classes requests up to this size are counted
+//in 8 byte steps
+#define LEARN_LIMIT 0x10000
+
+//a request size becomes a size class of its own if it makes up at
+//least 1/LEARN_PEAK_SHARE of the samples
+#define LEARN_PEAK_SHARE 200
+
+//marks a file as holding a persistent heap. The compact chunk format
+//has a magic of its own so neither build opens the other's files.
+#ifdef WMALLOC_COMPACT
+#define WMALLOC_PHEAP_MAGIC 0x70616568706d6163
+#else
+#define WMALLOC_PHEAP_MAGIC 0x70616568706d6177
+#endif
+
+//address space reserved for a persistent heap. The file only grows
+//as regions are carved out of it.
+#define PHEAP_CAPACITY 0x1000000000
+
+//marks a segment as holding a shared heap
+#ifdef WMALLOC_COMPACT
+#define WMALLOC_SHARED_MAGIC 0x6465726168736d63
+#else
+#define WMALLOC_SHARED_MAGIC 0x6465726168736d77
+#endif
+
+//marks the default heap as published in a stats segment
+#define WMALLOC_STATS_MAGIC 0x7374617473736d77
+
+//the words of a heap dump that are not chunks, see heap_dump
+#define WMALLOC_DUMP_MAGIC 0x706d7564706d6177
+#define DUMP_REGION 0x3f00000000000000
+#define DUMP_END 0x3e00000000000000
+
+//marks a heap in a cage and the address space the cage reserves. A
+//32 bit offset reaches all of it, see wmalloc_compress
+#define WMALLOC_CAGE_MAGIC 0x65676163706d6177
+#define WMALLOC_CAGE_SIZE 0x100000000
+
+//kinds of region in a heap dump
+#define DUMP_REGION_MAPPED 0
+#define DUMP_REGION_SMALL 1
+#define DUMP_REGION_SPAN 2
+
+//words in the first buffer a heap dump is collected in, it doubles
+//when it runs out
+#define DUMP_BUFFER_WORDS 512
+
+//the address space is split into granules of this size to tell which
+//arena a chunk belongs to. Arena regions start on a granule and
+//cover whole granules. The map has two levels.
+#define ARENA_GRANULE 0x20000
+#define ARENA_GRANULE_SHIFT 17
+#define ARENA_LEAF_BITS 16
+#define ARENA_ROOT_SIZE (1 << (48 - ARENA_GRANULE_SHIFT - ARENA_LEAF_BITS))
+
+#define MAX_ARENAS 64
+
+//allocations before a thread checks again which node it is on
+#define ARENA_RECHECK 256
+
+//retires between attempts to move the epoch on, see wmalloc_retire
+#define RETIRE_BATCH 64
+
+//size of the blocks scratch space is bumped out of and how many
+//released ones a thread keeps, see wmalloc_scratch_alloc
+#define SCRATCH_BLOCK_SIZE 0x10000
+#define SCRATCH_SPARE 4
+
+//NUMA policies and flags of mbind
+#define WMALLOC_MPOL_PREFERRED 1
+#define WMALLOC_MPOL_INTERLEAVE 3
+#define WMALLOC_MPOL_MF_MOVE 0x2
+
+//the links of an available chunk are offsets from the wmalloc_info
+//of its heap, see chunk_at. 0 is the end of the list.
+//
+//Compiled with WMALLOC_COMPACT the links are 32 bits, which takes 8
+//bytes off the smallest chunk. Every heap then lies in a cage so that
+//its chunks are within 4GB of its info, see initialize_wmalloc.
 struct chunk{
 
   uint64_t prev_chunk_size;
   uint64_t curr_chunk_size;
-  struct chunk* left_ptr;
-  struct chunk* right_ptr;
+#ifdef WMALLOC_COMPACT
+  uint32_t left_off;
+  uint32_t right_off;
+#else
+  uint64_t left_off;
+  uint64_t right_off;
+#endif
+};
+
+//the header at the start of every region mapped for a heap. The
+//regions of a heap are kept in a circular list so that they can all
+//be unmapped at once. 'colour' is the number of bytes the header was
+//moved on from the start of the mapping, see region_colour. 'size'
+//is the length of the whole mapping.
+struct region{
+
+  struct region* next;
+  struct region* prev;
+  uint64_t size;
+  uint64_t colour;
+};
+
+//what learning the size classes found, see wmalloc_learn_size_classes
+struct wmalloc_size_class_report{
+
+  //number of requests sampled
+  uint64_t samples;
+  //size classes added for peaks in the request sizes
+  int peaks;
+  //number of bins before and after
+  int old_bins;
+  int new_bins;
+  //average bytes between a request and the top of its bin
+  double old_waste;
+  double new_waste;
+};
+
+//counters kept by wmalloc
+struct wmalloc_stats{
+
+  //bytes currently mapped from the OS
+  uint64_t mapped_bytes;
+  //number of mmap calls made
+  uint64_t mmap_calls;
+
+  //bytes in chunks handed out, overhead included
+  uint64_t in_use_bytes;
+  uint64_t allocs;
+  uint64_t frees;
+  //requests that found nothing in their own bin
+  uint64_t bin_misses;
+  //requests that needed a new region
+  uint64_t region_allocs;
+
+  //available chunks in each bin. Only kept for a published heap,
+  //see wmalloc_stats_publish.
+  uint64_t bin_chunks[NUM_BINS];
 };
 
 
@@ -157,19 +677,414 @@ struct chunk{
 //the struct that holds the info for wmalloc
 struct wmalloc_info{
 
-  struct chunk* bin[NUM_BINS];
+  //WMALLOC_PHEAP_MAGIC or WMALLOC_SHARED_MAGIC and the size of this
+  //struct for a heap kept in a file or shared memory, so one from
+  //another layout is not taken for a heap. WMALLOC_CAGE_MAGIC for a
+  //heap in a cage.
+  uint64_t magic;
+  uint64_t info_size;
+  
+  //where a heap kept in a file was mapped last, tried first when it
+  //is opened again
+  uint64_t mapped_at;
+  
+  //each bin begins with a dummy node
   struct chunk dummy[NUM_BINS];
   uint64_t bin_index[NUM_BINS];
+  //number of bins in the size class layout
+  int num_bins;
+
+  //set once a second thread may touch the bins
+  int threaded;
+  pthread_mutex_t lock;
+
+  //when set wfree pushes chunks onto 'deferred' instead of
+  //consolidating them. Linked through right_off.
+  int defer_frees;
+  struct chunk* deferred;
+
+  //regions mapped ahead of time by the background thread, linked
+  //through right_off. Refilled up to 'reserve_high' whenever the
+  //count drops below 'reserve_low'. 'reserve_wanted' notes under the
+  //lock that the background thread has to be woken once it is dropped.
+  struct chunk* reserve;
+  int reserve_count;
+  int reserve_low;
+  int reserve_high;
+  int reserve_flags;
+  int reserve_wanted;
+
+  //placement policy and the roving pointers used for next fit
+  int policy;
+  uint64_t rover[NUM_BINS];
+
+  //for a NUMA arena its index + 1 and the node its regions are bound
+  //to, see wmalloc_numa_arenas. 0 and -1 for every other heap.
+  int arena;
+  int numa_node;
+
+  //address range for small chunks with WMALLOC_SEGREGATED
+  uint64_t small_base;
+  uint64_t small_top;
+  uint64_t small_end;
+
+  //regions coloured so far, picks the colour of the next one
+  uint64_t colour_next;
+
+  //histogram of request sizes while learning size classes
+  uint32_t* learn_hist;
+  uint64_t learn_remaining;
+  uint64_t learn_samples;
+  int learned;
+  struct wmalloc_size_class_report learn_report;
+
+  //the regions mapped for this heap, not counting the address range
+  //for small chunks
+  struct region regions;
+
+  //a heap whose regions are carved one after the other out of a
+  //single mapping of 'span_capacity' bytes starting at this struct
+  //rather than mapped one by one. 'span_top' is the offset of the first byte
+  //not handed out yet. A span_capacity of 0 for every other heap.
+  //'span_length' is the length of the mapping itself, with
+  //WMALLOC_COMPACT the span may use less of it.
+  //Regions of a persistent heap are backed by 'span_fd'.
+  uint64_t span_top;
+  uint64_t span_capacity;
+  uint64_t span_length;
+  int span_fd;
+
+  //offset of the object a persistent heap is found by on reopening
+  uint64_t root;
+
+  struct wmalloc_stats stats;
 };
 
-//the pointer to the struct that holds the available chunks
+//a heap of its own, see heap_create
+typedef struct wmalloc_info* wmalloc_heap_t;
+
+//refers to memory that compaction may move, see wmalloc_h
+typedef uint64_t wm_handle;
+
+//in a heap carved out of one mapping the regions start on the page
+//after the info
+#define SPAN_FIRST_REGION ((sizeof(struct wmalloc_info) + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1))
+
+//the pointer to the struct that holds the available chunks of the
+//default heap used by wmalloc and wfree
 struct wmalloc_info* wmalloc_ptr = NULL;
+
+//settings that can be changed at startup through WMALLOC_CONF
+struct wmalloc_config{
+
+  //size of the regions requested from the OS
+  uint64_t region_size;
+  //requests bigger than this get a region of their own
+  uint64_t mmap_threshold;
+
+  //start the background maintenance thread with this interval
+  uint64_t background_ms;
+  //decay for purging free pages
+  uint64_t decay_ms;
+
+  //keep this many premapped regions in reserve
+  int reserve_low;
+  int reserve_high;
+  int reserve_flags;
+
+  int policy;
+
+  //learn the size classes from this many requests
+  uint64_t learn_window;
+
+  //publish the counters of the default heap for wmstat
+  int publish_stats;
+
+  //number of NUMA arenas, 0 for none
+  int arenas;
+
+  //watch the memory pressure of the cgroup
+  int pressure;
+
+  //cache colours of the region starts, 0 or 1 for none
+  uint64_t colours;
+};
+
+struct wmalloc_config wmalloc_conf = {
+  .region_size = MMAP_SIZE,
+  .mmap_threshold = MMAP_SIZE,
+  .background_ms = 0,
+  .decay_ms = 10000,
+  .reserve_low = 0,
+  .reserve_high = 0,
+  .reserve_flags = 0,
+  .policy = WMALLOC_POLICY,
+  .learn_window = 0,
+  .publish_stats = 0,
+  .arenas = 0,
+  .pressure = 0,
+  .colours = WMALLOC_COLOURS
+};
+
+//the state of the background maintenance thread
+struct wmalloc_background{
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int running;
+
+  //set when the thread does the periodic maintenance passes
+  int maintain;
+  //time between passes
+  uint64_t interval_ms;
+  //free pages idle for about this long are purged
+  uint64_t decay_ms;
+  //when the next pass is due
+  struct timespec next_pass;
+
+  //set when the thread keeps the reserve of regions filled
+  int premap;
+  //set by wmalloc when the reserve drops below its low mark
+  int refill_requested;
+};
+
+struct wmalloc_background wmalloc_bg = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER
+};
+
+//what the background thread reads to tell how short of memory the
+//program is, see wmalloc_pressure_watch. A path is empty if the file
+//was not found.
+struct wmalloc_pressure{
+
+  int watch;
+  char current_path[PRESSURE_PATH_LENGTH];
+  char max_path[PRESSURE_PATH_LENGTH];
+  char psi_path[PRESSURE_PATH_LENGTH];
+  
+  //0 to 100 as of the last pass
+  int level;
+};
+
+struct wmalloc_pressure wmalloc_pressure;
+
+//functions called around allocations and region mappings, see
+//wmalloc_set_hooks. Any of them may be NULL and 'arg' is passed to
+//each as the last argument.
+struct wmalloc_hooks{
+
+  void (*pre_alloc)(wmalloc_heap_t heap, uint64_t request_length, void* arg);
+  void (*post_alloc)(wmalloc_heap_t heap, void* ptr, uint64_t request_length, void* arg);
+  void (*pre_free)(wmalloc_heap_t heap, void* ptr, void* arg);
+  void (*region_map)(wmalloc_heap_t heap, void* start, uint64_t length, void* arg);
+  void (*region_unmap)(wmalloc_heap_t heap, void* start, uint64_t length, void* arg);
+  void* arg;
+};
+
+struct wmalloc_hooks installed_hooks;
+
+//set while hooks are installed. It is the only thing the allocation
+//and free paths look at when there are none.
+int hooks_enabled = 0;
+
+//live bytes per tag counted by one thread. A thread only adds to its
+//own counters, also for chunks another thread allocated, so a total
+//is the sum over all threads.
+struct tag_counters{
+
+  int64_t live[WMALLOC_TAGS];
+  struct tag_counters* next;
+  //0 once the thread exited and the counters can be taken over
+  int in_use;
+};
+
+struct wmalloc_tags{
+
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  int key_created;
+  //every set of counters handed out
+  struct tag_counters* threads;
+  //soft limit per tag, 0 for none
+  uint64_t limit[WMALLOC_TAGS];
+};
+
+struct wmalloc_tags wmalloc_tags = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+__thread struct tag_counters* my_tag_counters = NULL;
+
+//the NUMA arenas, see wmalloc_numa_arenas
+struct wmalloc_arenas{
+
+  pthread_mutex_t lock;
+  int count;
+  int nodes;
+  struct wmalloc_info* heap[MAX_ARENAS];
+  
+  //the arena index + 1 of each granule, 0 for the default heap
+  uint8_t* map[ARENA_ROOT_SIZE];
+};
+
+struct wmalloc_arenas wmalloc_arenas = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+//the arena of this thread and the allocations left before its node
+//is checked again
+__thread struct wmalloc_info* my_arena = NULL;
+__thread int my_arena_uses = 0;
+
+//a thread taking part in epoch based reclamation, see wmalloc_retire
+struct epoch_thread{
+
+  //the epoch the thread last entered a critical section in, shifted
+  //up one, with the low bit set while it is in the section
+  uint64_t state;
+  struct epoch_thread* next;
+  //0 once the thread exited and the record can be taken over
+  int in_use;
+  uint64_t retired;
+
+  //retired pointers by epoch % 3 and the epoch each bag is from
+  void** bag[3];
+  uint64_t bag_count[3];
+  uint64_t bag_size[3];
+  uint64_t bag_epoch[3];
+};
+
+struct wmalloc_epochs{
+
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  int key_created;
+  uint64_t global;
+  //every record handed out
+  struct epoch_thread* threads;
+};
+
+struct wmalloc_epochs wmalloc_epochs = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+__thread struct epoch_thread* my_epoch = NULL;
+
+//a block of scratch space from wmalloc, the space follows it
+struct scratch_block{
+
+  struct scratch_block* prev;
+  uint64_t size;
+};
+
+//the scratch space of a thread. 'top' is where the next allocation
+//goes in the current block and 'end' where that block ends.
+struct scratch_state{
+
+  struct scratch_block* current;
+  char* top;
+  char* end;
+  //released blocks kept for reuse, linked through prev
+  struct scratch_block* spare;
+  int spare_count;
+};
+
+__thread struct scratch_state my_scratch;
+
+//frees the blocks of a thread that exits
+struct wmalloc_scratch{
+
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  int key_created;
+};
+
+struct wmalloc_scratch scratch = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+//what a handle refers to. 'ptr' is NULL while the handle is on the
+//free list, linked through 'next_free'.
+struct handle_entry{
+
+  void* ptr;
+  uint64_t pins;
+  wm_handle next_free;
+};
+
+//the handle table and the heap that handle allocations come from,
+//see wmalloc_h
+struct wmalloc_handles{
+
+  pthread_mutex_t lock;
+  struct wmalloc_info* heap;
+  struct handle_entry* entries;
+  uint64_t capacity;
+  wm_handle free_list;
+};
+
+struct wmalloc_handles wmalloc_handles = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+//a region of the heap a defragmentation scan is looking at, from its
+//first chunk to 'end', with the bytes in use once they are added up
+struct defrag_region{
+
+  struct chunk* first;
+  uint64_t end;
+  uint64_t used;
+};
+
+//the regions of the heap wmalloc_defrag_hint was last asked about,
+//sorted by address. Kept per process as a heap may be shared. The
+//counters of the heap tell when a region was mapped or unmapped.
+struct wmalloc_defrag{
+
+  pthread_mutex_t lock;
+  struct wmalloc_info* heap;
+  uint64_t mmap_calls;
+  uint64_t mapped_bytes;
+  struct defrag_region* regions;
+  uint64_t count;
+  uint64_t capacity;
+};
+
+struct wmalloc_defrag wmalloc_defrag = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+//a heap dump on its way out, see heap_dump
+struct dump_buffer{
+
+  int fd;
+  int failed;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t* words;
+};
+
+#define WMALLOC_HOOK(name, ...)                                         \
+  do{                                                                   \
+    if(__builtin_expect(hooks_enabled, 0) && installed_hooks.name != NULL){ \
+      installed_hooks.name(__VA_ARGS__, installed_hooks.arg);           \
+    }                                                                   \
+  }while(0)
   
 
 //--------------Initializing Functions-------------------------------
 
 int initialize_wmalloc();
-void initialize_bin_indices();
+void initialize_heap(struct wmalloc_info* heap);
+void initialize_bin_indices(struct wmalloc_info* heap);
+
+//--------------Runtime Configuration--------------------------------
+
+void read_config(struct wmalloc_info* heap, const char* conf);
+int parse_config_number(const char* value, const char* end, uint64_t* number);
+int parse_size_classes(struct wmalloc_info* heap, const char* spec, const char* end);
 
 
 //--------------General Purpose Functions----------------------------
@@ -187,25 +1102,236 @@ void set_next_flag(struct chunk* ch, int flag);
 void set_unavailable(struct chunk* ch);
 void set_available(struct chunk* ch);
 void set_adjacent_sizes(struct chunk* ch, int available);
-
-void add_chunk(struct chunk* to_add);
-void insert_in_place(struct chunk* head, struct chunk* to_add);
-int find_bin(uint64_t request_length);
-struct chunk* search_bin(int i, int request_length);
-struct chunk* check_bigger_bins(int i);
+struct chunk* chunk_at(struct wmalloc_info* heap, uint64_t offset);
+uint64_t offset_of(struct wmalloc_info* heap, struct chunk* ch);
+struct chunk* get_left(struct wmalloc_info* heap, struct chunk* ch);
+struct chunk* get_right(struct wmalloc_info* heap, struct chunk* ch);
+void set_left(struct wmalloc_info* heap, struct chunk* ch, struct chunk* left);
+void set_right(struct wmalloc_info* heap, struct chunk* ch, struct chunk* right);
+
+void lock_wmalloc(struct wmalloc_info* heap);
+void unlock_wmalloc(struct wmalloc_info* heap);
+
+void add_chunk(struct wmalloc_info* heap, struct chunk* to_add);
+int bin_of(struct wmalloc_info* heap, uint64_t chunk_size);
+void insert_in_place(struct wmalloc_info* heap, struct chunk* head, struct chunk* to_add);
+int find_bin(struct wmalloc_info* heap, uint64_t request_length);
+int chunk_fits(struct wmalloc_info* heap, struct chunk* ch, uint64_t request_length);
+struct chunk* search_bin(struct wmalloc_info* heap, int i, uint64_t request_length);
+struct chunk* check_bigger_bins(struct wmalloc_info* heap, int i, uint64_t request_length);
+struct chunk* find_chunk(struct wmalloc_info* heap, uint64_t request_length);
+
+//-------------Placement Policies------------------------------------
+
+int wmalloc_set_policy(int policy);
+void set_heap_policy(struct wmalloc_info* heap, int policy);
+int in_small_space(struct wmalloc_info* heap, struct chunk* ch);
+struct chunk* map_small_region(struct wmalloc_info* heap);
+uint64_t small_region_colour(struct wmalloc_info* heap, void* start);
+
+//-------------Adaptive Size Classes---------------------------------
+
+int wmalloc_learn_size_classes(uint64_t window);
+int wmalloc_size_class_report(struct wmalloc_size_class_report* report);
+void sample_request(struct wmalloc_info* heap, uint64_t request_length);
+void build_learned_classes(struct wmalloc_info* heap);
+double average_waste(struct wmalloc_info* heap, uint64_t* bin_index, int num_bins);
+void rebin_chunks(struct wmalloc_info* heap);
 
 //-------------Allocating Functions----------------------------------
 
 
 void* wmalloc(uint64_t request_length);
-struct chunk* allocate_chunk(uint64_t request_length);
-void split_chunk(struct chunk* to_remove, uint64_t request_length);
-struct chunk* remove_chunk(struct chunk* to_remove);
+void* heap_alloc(wmalloc_heap_t heap, uint64_t request_length);
+void* tagged_alloc(wmalloc_heap_t heap, uint64_t request_length, int tag);
+struct chunk* allocate_chunk(struct wmalloc_info* heap, uint64_t request_length);
+void note_new_region(struct wmalloc_info* heap, struct chunk* ch);
+struct chunk* map_region(struct wmalloc_info* heap, uint64_t mmap_length, int flags);
+uint64_t region_colour(uint64_t index);
+void* region_start(struct region* curr);
+struct chunk* take_reserve(struct wmalloc_info* heap);
+void request_refill();
+void split_chunk(struct wmalloc_info* heap, struct chunk* to_remove, uint64_t request_length);
+struct chunk* remove_chunk(struct wmalloc_info* heap, struct chunk* to_remove);
 
 //------------Freeing Functions--------------------------------------
 
 void wfree(void* to_free);
+void heap_free(wmalloc_heap_t heap, void* to_free);
+struct chunk* note_free(struct wmalloc_info* heap, void* to_free);
+void count_free(struct wmalloc_info* heap, struct chunk* ch);
+struct chunk* free_chunk(struct wmalloc_info* heap, struct chunk* ch);
 struct chunk* join_chunks(struct chunk* first, struct chunk* second);
+struct chunk* take_deferred(struct wmalloc_info* heap);
+void free_deferred(struct wmalloc_info* heap, struct chunk* list);
+void consolidate_deferred(struct wmalloc_info* heap);
+
+//------------Trimming Functions-------------------------------------
+
+uint64_t wmalloc_trim(uint64_t pad);
+uint64_t heap_trim(wmalloc_heap_t heap, uint64_t pad);
+int is_whole_region(struct chunk* ch);
+int can_unmap(struct wmalloc_info* heap, struct chunk* ch);
+int is_purged(struct chunk* ch);
+void set_purged(struct chunk* ch);
+void clear_purged(struct chunk* ch);
+uint64_t releasable_bytes(struct wmalloc_info* heap, struct chunk* ch);
+uint64_t retained_bytes(struct wmalloc_info* heap);
+struct chunk* find_trim_candidate(struct wmalloc_info* heap);
+uint64_t release_pages(struct chunk* ch);
+
+//------------Background Maintenance---------------------------------
+
+int wmalloc_background_start(uint64_t interval_ms, uint64_t decay_ms);
+int wmalloc_premap_start(int low, int high, int flags);
+void wmalloc_background_stop();
+int start_background_thread();
+void* background_main(void* arg);
+void background_pass(int watch);
+void decay_heap(struct wmalloc_info* heap, uint64_t decay_ms);
+void refill_reserve();
+
+//------------Heap Instances-----------------------------------------
+
+wmalloc_heap_t heap_create();
+void heap_destroy(wmalloc_heap_t heap);
+struct region* region_of(struct chunk* ch);
+void link_region(struct wmalloc_info* heap, struct chunk* ch);
+void unlink_region(struct chunk* ch);
+uint64_t heap_offset(wmalloc_heap_t heap, void* ptr);
+void* heap_pointer(wmalloc_heap_t heap, uint64_t offset);
+void initialize_span_heap(struct wmalloc_info* heap, uint64_t capacity);
+
+//------------Stats Segment------------------------------------------
+
+int wmalloc_stats_publish();
+void stats_segment_name(char* name, int pid);
+void unlink_stats_segment();
+void stats_fork_prepare();
+void stats_fork_parent();
+void stats_fork_child();
+
+//------------Persistent Heaps---------------------------------------
+
+wmalloc_heap_t wmalloc_pheap_open(const char* path);
+void wmalloc_pheap_close(wmalloc_heap_t heap);
+void wmalloc_pheap_set_root(wmalloc_heap_t heap, void* root);
+void* wmalloc_pheap_root(wmalloc_heap_t heap);
+struct chunk* carve_region(struct wmalloc_info* heap, uint64_t length);
+
+//------------Shared Heaps-------------------------------------------
+
+wmalloc_heap_t wmalloc_shared_create(const char* name, uint64_t capacity);
+wmalloc_heap_t wmalloc_shared_attach(const char* name);
+void wmalloc_shared_detach(wmalloc_heap_t heap);
+
+//------------Caller Provided Memory---------------------------------
+
+int wmalloc_init_with_buffer(void* buffer, uint64_t length);
+
+//------------Reserving Memory Up Front------------------------------
+
+int wmalloc_reserve(uint64_t bytes, int flags);
+int heap_reserve(wmalloc_heap_t heap, uint64_t bytes, int flags);
+
+//------------Memory Pressure----------------------------------------
+
+int wmalloc_pressure_watch(const char* cgroup_dir);
+int wmalloc_memory_pressure();
+void find_pressure_files(struct wmalloc_pressure* pressure, const char* dir);
+void find_own_cgroup(struct wmalloc_pressure* pressure);
+int read_pressure_level();
+int read_number_file(const char* path, uint64_t* value);
+uint64_t release_reserve();
+
+//------------Defragmentation----------------------------------------
+
+int wmalloc_defrag_hint(void* ptr);
+int heap_defrag_hint(wmalloc_heap_t heap, void* ptr);
+void wmalloc_defrag_scan();
+void drop_region_index(struct wmalloc_info* heap);
+int index_regions(struct wmalloc_info* heap);
+int add_defrag_region(struct chunk* first, uint64_t end);
+int compare_defrag_regions(const void* a, const void* b);
+struct defrag_region* defrag_region_of(struct wmalloc_info* heap, struct chunk* ch);
+uint64_t region_usage(struct wmalloc_info* heap, struct chunk* first);
+struct chunk* peek_chunk(struct wmalloc_info* heap, uint64_t request_length);
+
+//------------Handles and Compaction---------------------------------
+
+wm_handle wmalloc_h(uint64_t request_length);
+void* wmalloc_pin(wm_handle handle);
+void wmalloc_unpin(wm_handle handle);
+void wfree_h(wm_handle handle);
+uint64_t wmalloc_compact();
+void compact_region(struct wmalloc_info* heap, struct region* curr);
+struct chunk* slide_chunk(struct wmalloc_info* heap, struct chunk* gap, struct chunk* in_use);
+int grow_handles();
+
+//------------Pointer Compression------------------------------------
+
+wmalloc_heap_t wmalloc_cage_create();
+wmalloc_heap_t wmalloc_init_cage();
+void wmalloc_cage_destroy(wmalloc_heap_t cage);
+void* map_cage();
+uint32_t wmalloc_compress(wmalloc_heap_t cage, void* ptr);
+void* wmalloc_decompress(wmalloc_heap_t cage, uint32_t ref);
+
+//------------Hooks--------------------------------------------------
+
+int wmalloc_set_hooks(const struct wmalloc_hooks* hooks);
+
+//------------Tagged Allocations-------------------------------------
+
+void* wmalloc_tagged(uint64_t request_length, int tag);
+int wmalloc_tag_limit(int tag, uint64_t limit);
+uint64_t wmalloc_tag_usage(int tag);
+void count_tag(int tag, int64_t bytes);
+struct tag_counters* thread_tag_counters();
+void release_tag_counters(void* counters);
+
+//------------Heap Dumps---------------------------------------------
+
+int wmalloc_dump_heap(int fd);
+int heap_dump(wmalloc_heap_t heap, int fd);
+void dump_region(struct wmalloc_info* heap, struct dump_buffer* out, uint64_t kind,
+                 void* start, uint64_t length, struct chunk* first);
+int is_chunk_in_use(struct wmalloc_info* heap, struct chunk* ch);
+void dump_word(struct dump_buffer* out, uint64_t word);
+int grow_dump(struct dump_buffer* out);
+void flush_dump(struct dump_buffer* out);
+
+//------------NUMA Arenas--------------------------------------------
+
+int wmalloc_numa_arenas(int count);
+void* wmalloc_interleaved(uint64_t request_length);
+struct wmalloc_info* thread_arena();
+struct wmalloc_info* heap_of(void* ptr);
+void set_arena_range(void* start, uint64_t length, int arena);
+void* map_aligned(uint64_t length, int prot, int flags);
+void set_numa_policy(void* start, uint64_t length, int mode, uint64_t nodemask, int flags);
+int numa_node_count();
+
+//------------Bulk Free and Reclamation------------------------------
+
+void wfree_bulk(void** ptrs, uint64_t count);
+void wmalloc_epoch_enter();
+void wmalloc_epoch_exit();
+void wmalloc_retire(void* ptr);
+uint64_t wmalloc_retire_flush();
+void collect_retired(struct epoch_thread* thread, uint64_t epoch);
+void try_advance_epoch(uint64_t epoch);
+int grow_bag(struct epoch_thread* thread, int bag);
+struct epoch_thread* thread_epoch();
+void release_epoch_thread(void* record);
+
+//------------Scratch Space------------------------------------------
+
+void* wmalloc_scratch_mark();
+void* wmalloc_scratch_alloc(uint64_t length);
+void wmalloc_scratch_release(void* mark);
+struct scratch_block* scratch_block_for(uint64_t length);
+void release_scratch(void* state);
 
 
 
@@ -223,26 +1349,111 @@ struct chunk* join_chunks(struct chunk* first, struct chunk* second);
 */
 int initialize_wmalloc(){
 
+#ifdef WMALLOC_COMPACT
+  //the 32 bit links only reach the chunks of a cage
+  wmalloc_ptr = map_cage();
+#else
   wmalloc_ptr = sbrk(sizeof(struct wmalloc_info));
+#endif
 
   //check allocation
   if(wmalloc_ptr == (void*) -1){
+    wmalloc_ptr = NULL;
     return -1;
   }
 
+  initialize_heap(wmalloc_ptr);
+  initialize_bin_indices(wmalloc_ptr);
+
+  read_config(wmalloc_ptr, getenv("WMALLOC_CONF"));
+  wmalloc_ptr->policy = wmalloc_conf.policy;
+
+#ifdef WMALLOC_COMPACT
+  if(wmalloc_ptr->policy == WMALLOC_SEGREGATED){
+    wmalloc_ptr->policy = WMALLOC_BEST_FIT;
+  }
+  wmalloc_ptr->span_top = SPAN_FIRST_REGION;
+  wmalloc_ptr->span_capacity = WMALLOC_CAGE_SIZE;
+  wmalloc_ptr->span_length = WMALLOC_CAGE_SIZE;
+  wmalloc_ptr->stats.mapped_bytes = SPAN_FIRST_REGION;
+#endif
+
+  if(wmalloc_conf.publish_stats == 1){
+    wmalloc_stats_publish();
+  }
+
+  if(wmalloc_conf.reserve_high > 0){
+    wmalloc_premap_start(wmalloc_conf.reserve_low, wmalloc_conf.reserve_high,
+                         wmalloc_conf.reserve_flags);
+  }
+  if(wmalloc_conf.background_ms > 0){
+    wmalloc_background_start(wmalloc_conf.background_ms, wmalloc_conf.decay_ms);
+  }
+  if(wmalloc_conf.learn_window > 0){
+    wmalloc_learn_size_classes(wmalloc_conf.learn_window);
+  }
+  if(wmalloc_conf.arenas > 0){
+    wmalloc_numa_arenas(wmalloc_conf.arenas);
+  }
+  if(wmalloc_conf.pressure == 1){
+    wmalloc_pressure_watch(NULL);
+  }
+  
+  return 1;
+}
+
+/*
+  Set up the info of an empty heap. The bin layout is left to the
+  caller.
+*/
+void initialize_heap(struct wmalloc_info* heap){
+
+  heap->threaded = 0;
+  heap->defer_frees = 0;
+  heap->deferred = NULL;
+  pthread_mutex_init(&heap->lock, NULL);
+
+  heap->reserve = NULL;
+  heap->reserve_count = 0;
+  heap->reserve_low = 0;
+  heap->reserve_high = 0;
+  heap->reserve_flags = 0;
+  heap->reserve_wanted = 0;
+
+  heap->small_base = 0;
+  heap->small_top = 0;
+  heap->small_end = 0;
+  heap->colour_next = 0;
+  heap->arena = 0;
+  heap->numa_node = -1;
+  memset(&heap->stats, 0, sizeof(struct wmalloc_stats));
+
+  heap->learn_hist = NULL;
+  heap->learn_remaining = 0;
+  heap->learned = 0;
+
+  heap->regions.next = &heap->regions;
+  heap->regions.prev = &heap->regions;
+
+  heap->magic = 0;
+  heap->info_size = sizeof(struct wmalloc_info);
+  heap->mapped_at = 0;
+  heap->span_top = 0;
+  heap->span_capacity = 0;
+  heap->span_length = 0;
+  heap->span_fd = -1;
+  heap->root = 0;
+
   //each bin begins with a dummy node with chunk_size 0
   for(int i=0; i<NUM_BINS; i++){
     
-    wmalloc_ptr->dummy[i].curr_chunk_size = 0;
-    wmalloc_ptr->dummy[i].left_ptr = NULL;
-    wmalloc_ptr->dummy[i].right_ptr = NULL;
+    heap->dummy[i].curr_chunk_size = 0;
+    heap->dummy[i].left_off = 0;
+    heap->dummy[i].right_off = 0;
     
-    wmalloc_ptr->bin[i] = &wmalloc_ptr->dummy[i];
+    heap->rover[i] = 0;
   }
-
-  initialize_bin_indices();
-  
-  return 1;
+  return;
 }
 
 /*
@@ -257,38 +1468,310 @@ int initialize_wmalloc(){
   1 bin for anything larger than 524288
 */ 
 
-void initialize_bin_indices(){
+void initialize_bin_indices(struct wmalloc_info* heap){
 
-  assert(wmalloc_ptr != NULL);
+  assert(heap != NULL);
   
   int index=0;
   for(int i=40; i<=128; i=i+8){
-    wmalloc_ptr->bin_index[index] = i;
+    heap->bin_index[index] = i;
     index++;
   }
   for(int i=144; i<=256; i=i+16){
-    wmalloc_ptr->bin_index[index] = i;
+    heap->bin_index[index] = i;
     index++;
   }
   for(int i=288; i<=512; i=i+32){
-    wmalloc_ptr->bin_index[index] = i;
+    heap->bin_index[index] = i;
     index++;
   }
   for(int i=576; i<=1024; i=i+64){
-    wmalloc_ptr->bin_index[index] = i;
+    heap->bin_index[index] = i;
     index++;
   }
   for(int i=2048; i<1000000; i= i*2){
-    wmalloc_ptr->bin_index[index] = i;
+    heap->bin_index[index] = i;
     index++;
   }
 
   //set max bin limit
-  wmalloc_ptr->bin_index[index] = 0xffffffffffffffff;
+  heap->bin_index[index] = 0xffffffffffffffff;
+  heap->num_bins = index+1;
 
   return;  
 }
 
+/*
+  Apply the settings in a WMALLOC_CONF string, the size classes to
+  'heap' and the rest to wmalloc_conf. The string is a comma
+  separated list of key:value pairs, for example
+
+    WMALLOC_CONF="region_size:256k,policy:first_fit,decay_ms:5000"
+
+  Sizes take an optional k, m or g suffix. The keys are:
+
+  region_size     size of the regions requested from the OS,
+                  rounded up to whole pages (default 128k)
+  mmap_threshold  requests above this get a region of their own
+                  (default and upper limit: region_size)
+  background_ms   start the background maintenance thread with this
+                  interval (default 0, not started)
+  decay_ms        pages idle for about this long are purged by the
+                  background thread (default 10000)
+  reserve_low     keep between reserve_low and reserve_high premapped
+  reserve_high    regions in reserve (default 0, no reserve)
+  populate        1 to fault the reserved regions in up front
+  policy          best_fit, first_fit, next_fit, lifo or segregated
+  size_classes    the bin layout, see parse_size_classes
+  learn_window    learn the size classes from this many requests,
+                  see wmalloc_learn_size_classes
+  stats           1 to publish the counters for wmstat,
+                  see wmalloc_stats_publish
+  arenas          number of NUMA arenas, see wmalloc_numa_arenas
+  pressure        1 to trim harder as the cgroup runs short of
+                  memory, see wmalloc_pressure_watch
+  colours         cache colours of the region starts (default 16),
+                  0 for none, see region_colour
+
+  Unknown keys and bad values are reported and skipped.
+*/
+void read_config(struct wmalloc_info* heap, const char* conf){
+
+  if(conf == NULL){
+    return;
+  }
+
+  const char* names[] = {"best_fit", "first_fit", "next_fit", "lifo", "segregated"};
+  int threshold_set = 0;
+  
+  const char* curr = conf;
+  
+  while(*curr != '\0'){
+
+    const char* end = strchr(curr, ',');
+    if(end == NULL){
+      end = curr + strlen(curr);
+    }
+    
+    const char* colon = memchr(curr, ':', end - curr);
+    int ok = 0;
+
+    if(colon != NULL){
+
+      const char* key = curr;
+      uint64_t key_length = colon - curr;
+      const char* value = colon + 1;
+      uint64_t number;
+
+      #define CONFIG_KEY(name) (key_length == strlen(name) && strncmp(key, name, key_length) == 0)
+      
+      if(CONFIG_KEY("size_classes")){
+        ok = parse_size_classes(heap, value, end) != -1;
+      }
+      else if(CONFIG_KEY("policy")){
+
+        for(int i=0; i<5; i++){
+          if((uint64_t)(end - value) == strlen(names[i]) &&
+             strncmp(value, names[i], end - value) == 0){
+            wmalloc_conf.policy = i;
+            ok = 1;
+          }
+        }
+      }
+      else if(parse_config_number(value, end, &number) != -1){
+
+        ok = 1;
+        if(CONFIG_KEY("region_size") && number >= PAGE_SIZE){
+          wmalloc_conf.region_size = (number + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+        }
+        else if(CONFIG_KEY("mmap_threshold")){
+          wmalloc_conf.mmap_threshold = number;
+          threshold_set = 1;
+        }
+        else if(CONFIG_KEY("background_ms")){
+          wmalloc_conf.background_ms = number;
+        }
+        else if(CONFIG_KEY("decay_ms")){
+          wmalloc_conf.decay_ms = number;
+        }
+        else if(CONFIG_KEY("reserve_low")){
+          wmalloc_conf.reserve_low = number;
+        }
+        else if(CONFIG_KEY("reserve_high")){
+          wmalloc_conf.reserve_high = number;
+        }
+        else if(CONFIG_KEY("populate")){
+          wmalloc_conf.reserve_flags = number ? WMALLOC_PREMAP_POPULATE : 0;
+        }
+        else if(CONFIG_KEY("learn_window")){
+          wmalloc_conf.learn_window = number;
+        }
+        else if(CONFIG_KEY("stats")){
+          wmalloc_conf.publish_stats = number;
+        }
+        else if(CONFIG_KEY("arenas")){
+          wmalloc_conf.arenas = number;
+        }
+        else if(CONFIG_KEY("pressure")){
+          wmalloc_conf.pressure = number;
+        }
+        else if(CONFIG_KEY("colours") && number <= PAGE_SIZE/CACHE_LINE){
+          wmalloc_conf.colours = number;
+        }
+        else{
+          ok = 0;
+        }
+      }
+
+      #undef CONFIG_KEY
+    }
+
+    if(ok == 0){
+      printf("wmalloc: skipping bad WMALLOC_CONF option '%.*s'\n", (int)(end - curr), curr);
+    }
+    
+    curr = end;
+    if(*curr == ','){
+      curr++;
+    }
+  }
+
+  //the threshold follows the region size unless it was given
+  if(threshold_set == 0 || wmalloc_conf.mmap_threshold > wmalloc_conf.region_size){
+    wmalloc_conf.mmap_threshold = wmalloc_conf.region_size;
+  }
+  
+  return;
+}
+
+/*
+  Parse the number between 'value' and 'end' with an optional k, m
+  or g suffix.
+  Returns -1 if it is not a number.
+*/
+int parse_config_number(const char* value, const char* end, uint64_t* number){
+
+  if(value == end || *value < '0' || *value > '9'){
+    return -1;
+  }
+  
+  char* suffix;
+  *number = strtoull(value, &suffix, 10);
+
+  if(suffix < end){
+
+    if(*suffix == 'k' || *suffix == 'K'){
+      *number = (*number) << 10;
+    }
+    else if(*suffix == 'm' || *suffix == 'M'){
+      *number = (*number) << 20;
+    }
+    else if(*suffix == 'g' || *suffix == 'G'){
+      *number = (*number) << 30;
+    }
+    else{
+      return -1;
+    }
+    suffix++;
+  }
+
+  if(suffix != end){
+    return -1;
+  }
+  return 1;
+}
+
+/*
+  Set the bin layout from a size class spec: a '-' separated list of
+  limit/step pieces. Starting from MINIMUM_CHUNK_SIZE each piece adds
+  bins 'step' bytes apart up to 'limit'. A step of x2 doubles instead.
+  One more bin for anything larger is always added. The default
+  layout is
+
+    128/8-256/16-512/32-1024/64-524288/x2
+
+  Returns -1 and leaves the layout alone if the spec is bad or needs
+  more than NUM_BINS bins.
+*/
+int parse_size_classes(struct wmalloc_info* heap, const char* spec, const char* end){
+
+  uint64_t bin_index[NUM_BINS];
+  int index = 0;
+  
+  const char* curr = spec;
+  
+  while(curr < end){
+
+    const char* piece_end = memchr(curr, '-', end - curr);
+    if(piece_end == NULL){
+      piece_end = end;
+    }
+    const char* slash = memchr(curr, '/', piece_end - curr);
+    if(slash == NULL){
+      return -1;
+    }
+
+    uint64_t limit;
+    uint64_t step = 0;
+    int doubling = 0;
+
+    if(parse_config_number(curr, slash, &limit) == -1){
+      return -1;
+    }
+    if(piece_end - slash == 3 && slash[1] == 'x' && slash[2] == '2'){
+      doubling = 1;
+    }
+    else if(parse_config_number(slash + 1, piece_end, &step) == -1 || step == 0){
+      return -1;
+    }
+
+    uint64_t size;
+    if(index == 0){
+      size = MINIMUM_CHUNK_SIZE;
+    }
+    else if(doubling == 1){
+      size = bin_index[index-1]*2;
+    }
+    else{
+      size = bin_index[index-1] + step;
+    }
+
+    while(size <= limit){
+
+      //leave room for the last bin
+      if(index == NUM_BINS-1){
+        return -1;
+      }
+      bin_index[index] = size;
+      index++;
+      
+      if(doubling == 1){
+        size = size*2;
+      }
+      else{
+        size = size + step;
+      }
+    }
+
+    curr = piece_end;
+    if(curr < end){
+      curr++;
+    }
+  }
+
+  if(index == 0){
+    return -1;
+  }
+  
+  for(int i=0; i<index; i++){
+    heap->bin_index[i] = bin_index[i];
+  }
+  heap->bin_index[index] = 0xffffffffffffffff;
+  heap->num_bins = index+1;
+  
+  return 1;
+}
+
 /*
   Examines previous chunk. Returns 1 if prev chunk is 
   available to be joined. If previous chunk is in use
@@ -300,7 +1783,7 @@ int is_prev_available(struct chunk* ch){
   
   uint64_t prev_chunk_size = ch->prev_chunk_size;
 
-  if(prev_chunk_size != 0){
+  if((prev_chunk_size & SIZE_MASK) != 0){
     prev_chunk_size = prev_chunk_size >> 63;
 
     if(prev_chunk_size == 0){
@@ -323,7 +1806,7 @@ int is_next_available(struct chunk* ch){
   address = address + ch->curr_chunk_size - 8;
   uint64_t* ptr_to_size = (uint64_t*) address;
   
-  if((*ptr_to_size) != 0){
+  if(((*ptr_to_size) & SIZE_MASK) != 0){
 
     uint64_t next_chunk_size  = (*ptr_to_size);
     next_chunk_size = next_chunk_size>>63;
@@ -337,13 +1820,13 @@ int is_next_available(struct chunk* ch){
 /*
   Set the prev_chunk_size for chunk ch. This is an internal function
   and does not modify the prev chunk itself. Function preserves flag
-  in whatever state it is in before the call
+  and tag in whatever state they are in before the call
 */
 void set_prev_chunk_size(struct chunk* ch, uint64_t next_chunk_size){
 
   assert(ch != NULL);
   
-  uint64_t flag = (0x8000000000000000)&(ch->prev_chunk_size);
+  uint64_t flag = (0x8000000000000000|TAG_MASK)&(ch->prev_chunk_size);
   
   ch->prev_chunk_size = next_chunk_size + flag;
  
@@ -353,8 +1836,8 @@ void set_prev_chunk_size(struct chunk* ch, uint64_t next_chunk_size){
 
 /*
   Set the next_chunk_size for chunk ch. This is an internal function
-  and does not modify the next chunk itself. Function preserves flag
-  in whatever state it is in before the call
+  and does not modify the next chunk itself. Function preserves the
+  in use and purged flags in whatever state they are in before the call
 */
 void set_next_chunk_size(struct chunk* ch, uint64_t next_chunk_size){
 
@@ -365,16 +1848,16 @@ void set_next_chunk_size(struct chunk* ch, uint64_t next_chunk_size){
 
   uint64_t* ptr_to_size = (uint64_t*) address;
 
-  uint64_t flag = (0x8000000000000000)&(*ptr_to_size);
+  uint64_t flag = (IN_USE_FLAG|PURGED_FLAG)&(*ptr_to_size);
 
-  (*ptr_to_size) = next_chunk_size + flag;
+  (*ptr_to_size) = next_chunk_size | flag;
  
   return;
 }
 
 /*
   Returns the previous chunk size. Masks to exclude the available
-  flag.
+  flag and the tag.
 */
 uint64_t get_prev_chunk_size(struct chunk* ch){
 
@@ -382,13 +1865,14 @@ uint64_t get_prev_chunk_size(struct chunk* ch){
   
   uint64_t prev_chunk_size = ch->prev_chunk_size;
 
-  prev_chunk_size = prev_chunk_size & (0x7fffffffffffffff);
+  prev_chunk_size = prev_chunk_size & SIZE_MASK;
 
   return prev_chunk_size;
 }
 
 /*
-  Returns the next chunk size. Masks to exclude the availabl flag.
+  Returns the next chunk size. Masks to exclude the available and
+  purged flags.
 */
 uint64_t get_next_chunk_size(struct chunk* ch){
 
@@ -399,7 +1883,7 @@ uint64_t get_next_chunk_size(struct chunk* ch){
 
   uint64_t* ptr_to_size = (uint64_t*) address;
 
-  uint64_t next_chunk_size = (0x7fffffffffffffff)&(*ptr_to_size);
+  uint64_t next_chunk_size = SIZE_MASK&(*ptr_to_size);
 
   return next_chunk_size;
 }
@@ -566,331 +2050,4711 @@ void set_available(struct chunk* ch){
    //next chunk
    if(get_next_chunk_size(ch) != 0){
      struct chunk* next_chunk = get_next_chunk(ch);
-     next_chunk->prev_chunk_size = chunk_size;
+     next_chunk->prev_chunk_size = chunk_size | (next_chunk->prev_chunk_size & TAG_MASK);
    }
    return;
  }
-   
 
 /*
-  Find proper bin for chunk and insert into the proper place in the 
-  linked list at bin.
+  Returns the chunk at 'offset' from the info of the heap, or NULL for
+  offset 0.
+
+  Offsets are taken from the info so that the bins of a heap that is
+  mapped at different addresses, in a file or shared between
+  processes, are valid in every mapping. The arithmetic wraps around
+  for chunks below the info.
 */
-void add_chunk(struct chunk* to_add){
+struct chunk* chunk_at(struct wmalloc_info* heap, uint64_t offset){
 
-  assert(to_add != NULL);
-  
-  int i=0;
-  while(to_add->curr_chunk_size > wmalloc_ptr->bin_index[i]){
-    i++;
+  if(offset == 0){
+    return NULL;
   }
- 
-  //push onto proper linked list
-  insert_in_place(wmalloc_ptr->bin[i], to_add);
-  
-  return;
+  return (struct chunk*) ((uint64_t)heap + offset);
 }
 
 /*
-  Insert in doubly linked list in proper ascending order.
+  Returns the offset of chunk 'ch' from the info of the heap, or 0
+  for NULL
 */
-void insert_in_place(struct chunk* head, struct chunk* to_add){
-
-  assert(head != NULL);
-  
-  struct chunk* curr = head;
-
-  struct chunk* prev = curr;
-  curr = curr->right_ptr;
-
-  //general case
-  while(curr != NULL){
-
-    if(to_add->curr_chunk_size < curr->curr_chunk_size){
-
-      prev->right_ptr = to_add;
-      curr->left_ptr = to_add;
-      to_add->right_ptr = curr;
-      to_add->left_ptr = prev;
-      return;
-    }
+uint64_t offset_of(struct wmalloc_info* heap, struct chunk* ch){
 
-    prev = curr;
-    curr = curr->right_ptr;
+  if(ch == NULL){
+    return 0;
   }
-
-  //add as last element in list
-  prev->right_ptr = to_add;
-  to_add->left_ptr = prev;
-  to_add->right_ptr = NULL;
-
-  return;
+  return (uint64_t)ch - (uint64_t)heap;
 }
 
 /*
-  find the bin that the requested length should be in
+  Returns the chunk before 'ch' in its bin
 */
-int find_bin(uint64_t request_length){
-
-  //find proper linked list to search
-  int i=1;
-
-  while(request_length > wmalloc_ptr->bin_index[i] && i<NUM_BINS){
-    i++;
-  }
+struct chunk* get_left(struct wmalloc_info* heap, struct chunk* ch){
 
-  return i;
+  assert(ch != NULL);
+  
+  return chunk_at(heap, ch->left_off);
 }
 
 /*
-  Search the bin for a chunk that is greater than request_length.
-  If a suitable chunk is found remove and return it.
-  Otherwise return NULL.
+  Returns the chunk after 'ch' in its bin, or NULL at the end
 */
-struct chunk* search_bin(int i, int request_length){
+struct chunk* get_right(struct wmalloc_info* heap, struct chunk* ch){
 
-  struct chunk* curr = wmalloc_ptr->bin[i];
+  assert(ch != NULL);
   
-  while(curr != NULL){
-
-    if(curr->curr_chunk_size >= request_length){
-      curr = remove_chunk(curr);
-      break;
-    }
-    curr = curr->right_ptr;
-  }
-
-  return curr;
+  return chunk_at(heap, ch->right_off);
 }
 
 /*
-  Search the bins of chunks starting at wmalloc_ptr->bin[i+1]
-  The goal is to find the smallest chunk.
+  Link 'left' in before 'ch'
 */
-struct chunk* check_bigger_bins(int i){
+void set_left(struct wmalloc_info* heap, struct chunk* ch, struct chunk* left){
 
-  struct chunk* to_remove = NULL;
+  assert(ch != NULL);
+  
+  ch->left_off = offset_of(heap, left);
+  return;
+}
+
+/*
+  Link 'right' in after 'ch'
+*/
+void set_right(struct wmalloc_info* heap, struct chunk* ch, struct chunk* right){
+
+  assert(ch != NULL);
+  
+  ch->right_off = offset_of(heap, right);
+  return;
+}
+   
+
+/*
+  Take the lock on the bins. Only needed once a second thread, such
+  as the background maintenance thread, can reach them. Until then
+  this is a single predictable branch.
+*/
+void lock_wmalloc(struct wmalloc_info* heap){
+
+  if(heap->threaded == 1){
+
+    //a process died holding the lock of a shared heap
+    if(pthread_mutex_lock(&heap->lock) == EOWNERDEAD){
+      pthread_mutex_consistent(&heap->lock);
+    }
+  }
+  return;
+}
+
+/*
+  Release the lock taken with lock_wmalloc
+*/
+void unlock_wmalloc(struct wmalloc_info* heap){
+
+  if(heap->threaded == 1){
+    pthread_mutex_unlock(&heap->lock);
+  }
+  return;
+}
+
+/*
+  Find proper bin for chunk and insert into the proper place in the 
+  linked list at bin.
+*/
+void add_chunk(struct wmalloc_info* heap, struct chunk* to_add){
+
+  assert(to_add != NULL);
+  
+  int i = bin_of(heap, to_add->curr_chunk_size);
+ 
+  //push onto proper linked list
+  insert_in_place(heap, &heap->dummy[i], to_add);
+  
+  return;
+}
+
+/*
+  Returns the bin an available chunk of chunk_size is kept in
+*/
+int bin_of(struct wmalloc_info* heap, uint64_t chunk_size){
+
+  int i=0;
+  while(chunk_size > heap->bin_index[i]){
+    i++;
+  }
+  return i;
+}
+
+/*
+  Insert in doubly linked list. The order depends on the placement
+  policy:
+
+  best fit and segregated: ascending size
+  first fit and next fit: ascending address
+  LIFO: at the front
+*/
+void insert_in_place(struct wmalloc_info* heap, struct chunk* head, struct chunk* to_add){
+
+  assert(head != NULL);
+
+  if(heap->magic == WMALLOC_STATS_MAGIC){
+    heap->stats.bin_chunks[head - heap->dummy]++;
+  }
+  
+  struct chunk* curr = head;
+
+  struct chunk* prev = curr;
+  curr = get_right(heap, curr);
+
+  int policy = heap->policy;
+  
+  //general case
+  while(curr != NULL){
+
+    int goes_before;
+
+    if(policy == WMALLOC_LIFO){
+      goes_before = 1;
+    }
+    else if(policy == WMALLOC_FIRST_FIT || policy == WMALLOC_NEXT_FIT){
+      goes_before = to_add < curr;
+    }
+    else{
+      goes_before = to_add->curr_chunk_size < curr->curr_chunk_size;
+    }
+    
+    if(goes_before){
+
+      set_right(heap, prev, to_add);
+      set_left(heap, curr, to_add);
+      set_right(heap, to_add, curr);
+      set_left(heap, to_add, prev);
+      return;
+    }
+
+    prev = curr;
+    curr = get_right(heap, curr);
+  }
+
+  //add as last element in list
+  set_right(heap, prev, to_add);
+  set_left(heap, to_add, prev);
+  set_right(heap, to_add, NULL);
+
+  return;
+}
+
+/*
+  find the bin that the requested length should be in
+*/
+int find_bin(struct wmalloc_info* heap, uint64_t request_length){
+
+  //find proper linked list to search
+  int i=0;
+
+  while(request_length > heap->bin_index[i] && i<heap->num_bins){
+    i++;
+  }
+
+  return i;
+}
+
+/*
+  Returns 1 if available chunk 'ch' can serve request_length.
+  With WMALLOC_SEGREGATED small requests only take chunks from the
+  small address range and all other requests only take chunks from
+  outside it.
+*/
+int chunk_fits(struct wmalloc_info* heap, struct chunk* ch, uint64_t request_length){
+
+  if(ch->curr_chunk_size < request_length){
+    return 0;
+  }
+  
+  if(heap->policy == WMALLOC_SEGREGATED){
+
+    int small_request = request_length <= SMALL_CHUNK_LIMIT;
+    if(in_small_space(heap, ch) != small_request){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Search the bin for a chunk that is greater than request_length.
+  If a suitable chunk is found remove and return it.
+  Otherwise return NULL.
+
+  With WMALLOC_NEXT_FIT the search starts where the last one in this
+  bin left off and wraps around.
+*/
+struct chunk* search_bin(struct wmalloc_info* heap, int i, uint64_t request_length){
+
+  struct chunk* head = &heap->dummy[i];
+  struct chunk* start = get_right(heap, head);
+
+  if(heap->policy == WMALLOC_NEXT_FIT && heap->rover[i] != 0){
+    start = chunk_at(heap, heap->rover[i]);
+  }
+  
+  struct chunk* curr = start;
+  
+  while(curr != NULL){
+
+    if(chunk_fits(heap, curr, request_length) == 1){
+      break;
+    }
+    curr = get_right(heap, curr);
+  }
+
+  //wrap around to the chunks before the rover
+  if(curr == NULL && start != get_right(heap, head)){
+
+    curr = get_right(heap, head);
+    while(curr != start){
+
+      if(chunk_fits(heap, curr, request_length) == 1){
+        break;
+      }
+      curr = get_right(heap, curr);
+    }
+    if(curr == start){
+      curr = NULL;
+    }
+  }
+
+  if(curr != NULL){
+    
+    if(heap->policy == WMALLOC_NEXT_FIT){
+      heap->rover[i] = curr->right_off;
+    }
+    curr = remove_chunk(heap, curr);
+  }
+  
+  return curr;
+}
+
+/*
+  Search the bins of chunks starting at bin i+1
+  The goal is to find the smallest chunk.
+*/
+struct chunk* check_bigger_bins(struct wmalloc_info* heap, int i, uint64_t request_length){
+
+  struct chunk* to_remove = NULL;
+  
+  i++;
+  while(i < heap->num_bins && to_remove == NULL){
+
+    struct chunk* curr = get_right(heap, &heap->dummy[i]);
+    while(curr != NULL){
+
+      if(chunk_fits(heap, curr, request_length) == 1){
+        to_remove = remove_chunk(heap, curr);
+        break;
+      }
+      curr = get_right(heap, curr);
+    }
+    i++;
+  }
+  
+  return to_remove;
+}
+
+/*
+  Look for an available chunk of at least request_length, first in
+  its own bin and then in the bigger bins. The chunk is removed from
+  its bin. Returns NULL if the bins have nothing suitable.
+*/
+struct chunk* find_chunk(struct wmalloc_info* heap, uint64_t request_length){
+
+  int i = find_bin(heap, request_length);
+
+  struct chunk* to_remove =  search_bin(heap, i, request_length);
+
+  //check for a chunk in a bigger bin
+  if(to_remove == NULL){
+
+    WMALLOC_PROBE3(bin_miss, heap, i, request_length);
+    __atomic_add_fetch(&heap->stats.bin_misses, 1, __ATOMIC_RELAXED);
+    to_remove = check_bigger_bins(heap, i, request_length);
+  }
+
+  return to_remove;
+}
+
+/*
+  Choose how available chunks are ordered in the bins and which one
+  a request takes:
+
+  WMALLOC_BEST_FIT   - bins by ascending size, the smallest chunk
+                       that fits is taken. The default.
+  WMALLOC_FIRST_FIT  - bins by ascending address, the lowest chunk
+                       that fits is taken.
+  WMALLOC_NEXT_FIT   - bins by ascending address, each search
+                       starts where the last one in the bin stopped.
+  WMALLOC_LIFO       - the most recently freed chunk that fits is
+                       taken.
+  WMALLOC_SEGREGATED - best fit, but chunks up to SMALL_CHUNK_LIMIT
+                       come from regions in an address range of
+                       their own, away from the larger chunks.
+
+  The starting policy can be set at compile time with WMALLOC_POLICY.
+  Chunks already in the bins keep their order, so switching is best
+  done before allocating or after a wmalloc_trim. The policy applies
+  to the default heap and the NUMA arenas. Heaps from heap_create
+  keep the policy they started with.
+
+  Returns -1 for an unknown policy.
+*/
+int wmalloc_set_policy(int policy){
+
+  if(policy < WMALLOC_BEST_FIT || policy > WMALLOC_SEGREGATED){
+    return -1;
+  }
+  
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  set_heap_policy(wmalloc_ptr, policy);
+
+  int count = __atomic_load_n(&wmalloc_arenas.count, __ATOMIC_ACQUIRE);
+  for(int i=0; i<count; i++){
+    set_heap_policy(wmalloc_arenas.heap[i], policy);
+  }
+  
+  return 1;
+}
+
+/*
+  Switch 'heap' to 'policy' and forget where next fit left off
+*/
+void set_heap_policy(struct wmalloc_info* heap, int policy){
+
+  //there is no address range for small chunks in a span
+  if(policy == WMALLOC_SEGREGATED && heap->span_capacity != 0){
+    policy = WMALLOC_BEST_FIT;
+  }
+  
+  lock_wmalloc(heap);
+  
+  heap->policy = policy;
+  for(int i=0; i<NUM_BINS; i++){
+    heap->rover[i] = 0;
+  }
+  
+  unlock_wmalloc(heap);
+  
+  return;
+}
+
+/*
+  The colour of the small region that starts at 'start'
+*/
+uint64_t small_region_colour(struct wmalloc_info* heap, void* start){
+
+  return region_colour(((uint64_t)start - heap->small_base)/wmalloc_conf.region_size);
+}
+
+/*
+  Returns 1 if the chunk lies in the address range for small chunks
+*/
+int in_small_space(struct wmalloc_info* heap, struct chunk* ch){
+
+  uint64_t address = (uint64_t)ch;
+
+  if(address >= heap->small_base && address < heap->small_end){
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Map a region in the address range for small chunks.
+  The range is reserved without any memory behind it the first time
+  through and regions are mapped into it one after the other.
+  Returns NULL once the range is used up.
+  The caller holds the lock.
+*/
+struct chunk* map_small_region(struct wmalloc_info* heap){
+
+  if(heap->small_base == 0){
+
+    void* space;
+    if(heap->arena != 0){
+      space = map_aligned(SMALL_SPACE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE);
+    }
+    else{
+      space = mmap(NULL, SMALL_SPACE_SIZE, PROT_NONE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    }
+    if(space == (void*) -1){
+      return NULL;
+    }
+    heap->small_base = (uint64_t)space;
+    heap->small_top = (uint64_t)space;
+    heap->small_end = (uint64_t)space + SMALL_SPACE_SIZE;
+  }
+
+  uint64_t region_size = wmalloc_conf.region_size;
+  
+  if(heap->small_top + region_size > heap->small_end){
+    return NULL;
+  }
+  
+  void* mmap_ptr = mmap((void*)heap->small_top, region_size, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+  if(mmap_ptr == (void*) -1){
+    return NULL;
+  }
+  if(heap->numa_node >= 0){
+    set_numa_policy(mmap_ptr, region_size, WMALLOC_MPOL_PREFERRED, (uint64_t)1 << heap->numa_node, 0);
+  }
+  if(heap->arena != 0){
+    set_arena_range(mmap_ptr, region_size, heap->arena);
+  }
+  
+  heap->small_top = heap->small_top + region_size;
+  __atomic_add_fetch(&heap->stats.mapped_bytes, region_size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&heap->stats.mmap_calls, 1, __ATOMIC_RELAXED);
+  WMALLOC_HOOK(region_map, heap, mmap_ptr, region_size);
+
+  //a small region has no header, its colour follows from its place
+  uint64_t colour = small_region_colour(heap, mmap_ptr);
+  struct chunk* new_chunk = (struct chunk*) ((uint64_t)mmap_ptr + colour);
+    
+  set_prev_chunk_size(new_chunk, 0);
+  new_chunk -> curr_chunk_size = region_size - colour;
+  set_next_chunk_size(new_chunk, 0);
+  
+  return new_chunk;
+}
+
+ 
+/*
+  The meat of the wmalloc program:
+  Returns a void pointer to a chunk of at least the requested size +
+  overhead.
+  The wmalloc data structure is initialized if first call to wmalloc.
+
+  Probes (provider wmalloc, see the usage notes at the top):
+  wmalloc_entry(heap, request), wmalloc_return(heap, ptr, request),
+  bin_miss(heap, bin, length), allocate_chunk(heap, chunk, size) for
+  a new region but not one from the reserve, see note_new_region
+
+  Process for getting memory:
+  1. Look in proper bin
+  2. Look in bins of greater size
+  3. Consolidate any deferred frees and look again
+  4. Use MMAP to get more memory from OS
+
+  Split the memory if the chunk of memory can satisfy the request and 
+  has a usable amount left over as well. Reinsert the split off chunk
+  and return the properly sized chunk
+*/
+void* wmalloc(uint64_t request_length){
+
+  //initialize malloc struct if first time calling my_malloc
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      printf("ERROR in Initializing malloc\n\n");
+      return NULL;
+    }
+  }
+
+  if(__builtin_expect(wmalloc_arenas.count != 0, 0)){
+    return heap_alloc(thread_arena(), request_length);
+  }
+  return heap_alloc(wmalloc_ptr, request_length);
+}
+
+/*
+  wmalloc from the given heap
+*/
+void* heap_alloc(wmalloc_heap_t heap, uint64_t request_length){
+
+  return tagged_alloc(heap, request_length, 0);
+}
+
+/*
+  heap_alloc for a chunk that counts towards 'tag'. Tag 0 is not
+  counted.
+*/
+void* tagged_alloc(wmalloc_heap_t heap, uint64_t request_length, int tag){
+
+  WMALLOC_PROBE2(wmalloc_entry, heap, request_length);
+  WMALLOC_HOOK(pre_alloc, heap, request_length);
+  
+  uint64_t necessary_length = request_length + CHUNK_OVERHEAD;
+
+  //if requesting less than the minimum reset to minimum
+  if(necessary_length < MINIMUM_CHUNK_SIZE){
+
+    necessary_length = MINIMUM_CHUNK_SIZE;
+  }
+
+  lock_wmalloc(heap);
+
+  if(heap->learn_remaining != 0){
+    sample_request(heap, necessary_length);
+  }
+  
+  struct chunk* to_remove = find_chunk(heap, necessary_length);
+
+  //frees the background thread has not got to yet
+  if(to_remove == NULL && __atomic_load_n(&heap->deferred, __ATOMIC_RELAXED) != NULL){
+
+    free_deferred(heap, take_deferred(heap));
+    to_remove = find_chunk(heap, necessary_length);
+  }
+
+  //request more memory from OS
+  if(to_remove == NULL){
+
+    to_remove =  allocate_chunk(heap, necessary_length);
+
+    if(to_remove == NULL){
+      unlock_wmalloc(heap);
+      errno = ENOMEM;
+      WMALLOC_PROBE3(wmalloc_return, heap, NULL, request_length);
+      WMALLOC_HOOK(post_alloc, heap, NULL, request_length);
+      return NULL;
+    }
+  }
+
+  split_chunk(heap, to_remove, necessary_length);
+
+  int refill = heap->reserve_wanted;
+  heap->reserve_wanted = 0;
+
+  //neighbors rewrite the header under the lock as well
+  to_remove->prev_chunk_size = (to_remove->prev_chunk_size & ~((uint64_t)TAG_MASK))
+                               | ((uint64_t)tag << TAG_SHIFT);
+
+  //the lock is held, only the frees of a published heap count
+  //outside it, see note_free
+  heap->stats.allocs++;
+  if(heap->magic == WMALLOC_STATS_MAGIC){
+    __atomic_add_fetch(&heap->stats.in_use_bytes, to_remove->curr_chunk_size, __ATOMIC_RELAXED);
+  }
+  else{
+    heap->stats.in_use_bytes = heap->stats.in_use_bytes + to_remove->curr_chunk_size;
+  }
+
+  unlock_wmalloc(heap);
+
+  if(refill == 1){
+    request_refill();
+  }
+  
+  if(tag != 0){
+    count_tag(tag, to_remove->curr_chunk_size);
+  }
+
+  //add 16 bytes to get to the user pointer
+  uint64_t address = (uint64_t) to_remove;
+  address = address+16;
+
+  void* ret_ptr = (void*) address;
+
+  WMALLOC_PROBE3(wmalloc_return, heap, ret_ptr, request_length);
+  WMALLOC_HOOK(post_alloc, heap, ret_ptr, request_length);
+  
+  return ret_ptr;
+}
+
+
+/*
+  Learn the size classes from the next 'window' requests.
+
+  The sizes of those requests are counted. Once the window is over
+  every size that makes up at least 1/LEARN_PEAK_SHARE of the samples
+  gets a bin whose upper limit is exactly that size, on top of the
+  current layout, and the available chunks are moved to their new
+  bins. Sizes above LEARN_LIMIT are left to the existing bins.
+
+  How well the bins fit the requests is reported through
+  wmalloc_size_class_report as the average distance between a request
+  and the top of its bin, before and after. That is the internal
+  fragmentation a size class allocator would see and how far a
+  search has to look past a request in its bin.
+
+  Returns -1 if the histogram could not be mapped.
+*/
+int wmalloc_learn_size_classes(uint64_t window){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  uint64_t hist_size = (LEARN_LIMIT/8+1)*sizeof(uint32_t);
+  uint32_t* hist = mmap(NULL, hist_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+  if(hist == (void*) -1){
+    return -1;
+  }
+  
+  lock_wmalloc(wmalloc_ptr);
+
+  if(wmalloc_ptr->learn_hist != NULL){
+    munmap(wmalloc_ptr->learn_hist, hist_size);
+  }
+  wmalloc_ptr->learn_hist = hist;
+  wmalloc_ptr->learn_samples = 0;
+  wmalloc_ptr->learn_remaining = window;
+
+  unlock_wmalloc(wmalloc_ptr);
+  
+  return 1;
+}
+
+/*
+  Copy out what the last round of learning found.
+  Returns -1 if no size classes have been learned yet.
+*/
+int wmalloc_size_class_report(struct wmalloc_size_class_report* report){
+
+  if(wmalloc_ptr == NULL || wmalloc_ptr->learned == 0){
+    return -1;
+  }
+
+  lock_wmalloc(wmalloc_ptr);
+  *report = wmalloc_ptr->learn_report;
+  unlock_wmalloc(wmalloc_ptr);
+  
+  return 1;
+}
+
+/*
+  Count one request while learning.
+  The caller holds the lock.
+*/
+void sample_request(struct wmalloc_info* heap, uint64_t request_length){
+
+  if(request_length <= LEARN_LIMIT){
+    heap->learn_hist[(request_length+7)/8]++;
+  }
+  heap->learn_samples++;
+  heap->learn_remaining--;
+
+  if(heap->learn_remaining == 0){
+    build_learned_classes(heap);
+  }
+  return;
+}
+
+/*
+  Add a bin for each peak in the histogram, move the available chunks
+  over and fill in the report. The histogram is unmapped afterwards.
+  The caller holds the lock.
+*/
+void build_learned_classes(struct wmalloc_info* heap){
+
+  uint32_t* hist = heap->learn_hist;
+  uint64_t buckets = LEARN_LIMIT/8+1;
+  uint64_t threshold = heap->learn_samples/LEARN_PEAK_SHARE;
+
+  if(threshold == 0){
+    threshold = 1;
+  }
+  
+  struct wmalloc_size_class_report* report = &heap->learn_report;
+  report->samples = heap->learn_samples;
+  report->old_bins = heap->num_bins;
+  report->old_waste = average_waste(heap, heap->bin_index, heap->num_bins);
+  report->peaks = 0;
+  
+  //merge the peaks into the current limits, both in ascending order
+  uint64_t bin_index[NUM_BINS];
+  int index = 0;
+  int old = 0;
+  uint64_t bucket = MINIMUM_CHUNK_SIZE/8;
+
+  while(index < NUM_BINS-1){
+
+    uint64_t next_old = heap->bin_index[old];
+    
+    //skip to the next peak
+    while(bucket < buckets && hist[bucket] < threshold){
+      bucket++;
+    }
+    uint64_t next_peak = (bucket < buckets) ? bucket*8 : 0xffffffffffffffff;
+
+    if(next_old == 0xffffffffffffffff && next_peak == 0xffffffffffffffff){
+      break;
+    }
+    
+    if(next_peak < next_old){
+      bin_index[index] = next_peak;
+      report->peaks++;
+      bucket++;
+    }
+    else{
+      bin_index[index] = next_old;
+      old++;
+      if(next_peak == next_old){
+        bucket++;
+      }
+    }
+    index++;
+  }
+  bin_index[index] = 0xffffffffffffffff;
+
+  for(int i=0; i<=index; i++){
+    heap->bin_index[i] = bin_index[i];
+  }
+  heap->num_bins = index+1;
+
+  report->new_bins = heap->num_bins;
+  report->new_waste = average_waste(heap, heap->bin_index, heap->num_bins);
+
+  rebin_chunks(heap);
+  
+  munmap(hist, buckets*sizeof(uint32_t));
+  heap->learn_hist = NULL;
+  heap->learned = 1;
+  
+  return;
+}
+
+/*
+  The average distance between a sampled request and the upper limit
+  of the bin it falls in, over the samples in the histogram.
+*/
+double average_waste(struct wmalloc_info* heap, uint64_t* bin_index, int num_bins){
+
+  uint32_t* hist = heap->learn_hist;
+  uint64_t total = 0;
+  uint64_t count = 0;
+  int i = 0;
+  
+  for(uint64_t bucket=1; bucket<=LEARN_LIMIT/8; bucket++){
+
+    uint64_t size = bucket*8;
+    while(i < num_bins-1 && size > bin_index[i]){
+      i++;
+    }
+    if(i < num_bins-1){
+      total = total + (bin_index[i] - size)*hist[bucket];
+      count = count + hist[bucket];
+    }
+  }
+
+  if(count == 0){
+    return 0;
+  }
+  return (double)total/count;
+}
+
+/*
+  After the bin limits change move every available chunk to the bin
+  it now belongs in.
+  The caller holds the lock.
+*/
+void rebin_chunks(struct wmalloc_info* heap){
+
+  struct chunk* list = NULL;
+  
+  for(int i=0; i<NUM_BINS; i++){
+
+    struct chunk* curr = get_right(heap, &heap->dummy[i]);
+    while(curr != NULL){
+      struct chunk* next = get_right(heap, curr);
+      set_right(heap, curr, list);
+      list = curr;
+      curr = next;
+    }
+    set_right(heap, &heap->dummy[i], NULL);
+    heap->rover[i] = 0;
+    heap->stats.bin_chunks[i] = 0;
+  }
+
+  while(list != NULL){
+    struct chunk* next = get_right(heap, list);
+    add_chunk(heap, list);
+    list = next;
+  }
+  return;
+}
+
+/*
+  Get a new chunk of memory from OS
+  Return a block of at least the region size
+
+  Requests up to the mmap threshold, less the largest colour, are
+  served from the reserve of premapped regions when it has any,
+  otherwise MMAP is used. Bigger requests get a region of their own.
+*/
+struct chunk* allocate_chunk(struct wmalloc_info* heap, uint64_t required_length){
+  
+  uint64_t mmap_length;
+
+  if(heap->policy == WMALLOC_SEGREGATED && required_length <= SMALL_CHUNK_LIMIT){
+
+    struct chunk* new_chunk = map_small_region(heap);
+    if(new_chunk != NULL){
+      note_new_region(heap, new_chunk);
+      return new_chunk;
+    }
+  }
+  
+  //regions of a span are not coloured, see carve_region
+  uint64_t room = required_length + sizeof(struct region);
+  if(heap->span_capacity == 0){
+    room = room + region_colour(wmalloc_conf.colours - 1);
+  }
+  int colour = 0;
+  
+  if(room <= wmalloc_conf.mmap_threshold){
+
+    if(heap->reserve != NULL){
+      return take_reserve(heap);
+    }
+    
+    mmap_length = wmalloc_conf.region_size;
+    colour = MAP_COLOUR;
+  }
+  else{
+    //set to the smallest multiple of PAGE_SIZE that exceeds request_size
+    //and the region header
+    mmap_length= ((required_length + sizeof(struct region))/PAGE_SIZE+1)*PAGE_SIZE;
+  }
+
+  if(heap->arena != 0){
+    mmap_length = (mmap_length + ARENA_GRANULE - 1) & ~((uint64_t)ARENA_GRANULE - 1);
+  }
+  
+  if(heap->span_capacity != 0){
+
+    //the end of a span is handed out as a smaller last region
+    uint64_t left = heap->span_capacity - heap->span_top;
+    if(left < mmap_length && left >= required_length + sizeof(struct region)){
+      mmap_length = left;
+    }
+    struct chunk* new_chunk = carve_region(heap, mmap_length);
+    if(new_chunk != NULL){
+      note_new_region(heap, new_chunk);
+    }
+    return new_chunk;
+  }
+
+  struct chunk* new_chunk = map_region(heap, mmap_length, colour);
+  if(new_chunk != NULL){
+    link_region(heap, new_chunk);
+    note_new_region(heap, new_chunk);
+  }
+  return new_chunk;
+}
+
+/*
+  The probe and counter of a request that needed a new region. A
+  region taken from the reserve was mapped ahead of time and does not
+  count.
+  The caller holds the lock.
+*/
+void note_new_region(struct wmalloc_info* heap, struct chunk* ch){
+
+  WMALLOC_PROBE3(allocate_chunk, heap, ch, ch->curr_chunk_size);
+  heap->stats.region_allocs++;
+
+  return;
+}
+
+/*
+  Use MMAP to get a region of mmap_length bytes and set it up as a
+  single chunk with no neighbors after the region header. With
+  WMALLOC_PREMAP_POPULATE in 'flags' the pages are faulted in up front.
+  The region still has to be linked into the heap with link_region.
+  Returns NULL if mmap fails.
+*/
+struct chunk* map_region(struct wmalloc_info* heap, uint64_t mmap_length, int flags){
+
+  int mmap_flags = MAP_PRIVATE|MAP_ANONYMOUS;
+
+  if((flags & WMALLOC_PREMAP_POPULATE) != 0){
+    mmap_flags = mmap_flags|MAP_POPULATE;
+  }
+  
+  void* mmap_ptr;
+  if(heap->arena != 0){
+    mmap_ptr = map_aligned(mmap_length, PROT_READ|PROT_WRITE, mmap_flags);
+  }
+  else{
+    mmap_ptr = mmap(NULL, mmap_length, PROT_READ|PROT_WRITE, mmap_flags, -1, 0);
+  }
+
+  if(mmap_ptr == (void*) -1){
+    printf("\n\nmmap failed\n\n");
+    return NULL;
+  }
+
+  //before the first page is touched
+  if(heap->numa_node >= 0){
+    set_numa_policy(mmap_ptr, mmap_length, WMALLOC_MPOL_PREFERRED, (uint64_t)1 << heap->numa_node, 0);
+  }
+  if(heap->arena != 0){
+    set_arena_range(mmap_ptr, mmap_length, heap->arena);
+  }
+ 
+  __atomic_add_fetch(&heap->stats.mapped_bytes, mmap_length, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&heap->stats.mmap_calls, 1, __ATOMIC_RELAXED);
+  WMALLOC_HOOK(region_map, heap, mmap_ptr, mmap_length);
+  
+  uint64_t colour = 0;
+  if((flags & MAP_COLOUR) != 0){
+    colour = region_colour(__atomic_fetch_add(&heap->colour_next, 1, __ATOMIC_RELAXED));
+  }
+  
+  struct region* new_region = (struct region*) ((uint64_t)mmap_ptr + colour);
+  new_region->size = mmap_length;
+  new_region->colour = colour;
+  
+  //the chunk starts right after the region header
+  struct chunk* new_chunk = (struct chunk*) (new_region + 1);
+    
+  set_prev_chunk_size(new_chunk, 0);
+  new_chunk -> curr_chunk_size = mmap_length - colour - sizeof(struct region);
+  set_next_chunk_size(new_chunk, 0);
+  
+  return new_chunk;
+}
+
+/*
+  The number of bytes the first chunk of the 'index'th region is moved
+  on from the start of the mapping.
+
+  Every region starts on a page, so the chunks at the same place in
+  regions laid out alike fall into the same cache sets and evict each
+  other. Moving each region on by one more cache line, over
+  wmalloc_conf.colours lines, spreads them over that many sets at the
+  cost of at most a page per region.
+*/
+uint64_t region_colour(uint64_t index){
+
+  if(wmalloc_conf.colours <= 1){
+    return 0;
+  }
+  return (index % wmalloc_conf.colours)*CACHE_LINE;
+}
+
+/*
+  Returns the start of the mapping of a region, before its colour
+*/
+void* region_start(struct region* curr){
+
+  return (void*)((uint64_t)curr - curr->colour);
+}
+
+/*
+  Pop a premapped region off the reserve. Asks the background thread
+  for more once the reserve runs low.
+  The caller holds the lock.
+*/
+struct chunk* take_reserve(struct wmalloc_info* heap){
+
+  struct chunk* new_chunk = heap->reserve;
+
+  heap->reserve = get_right(heap, new_chunk);
+  heap->reserve_count--;
+  set_right(heap, new_chunk, NULL);
+
+  //the caller holds the lock of the heap, wmalloc_bg.lock is only
+  //taken once it is dropped, see request_refill
+  if(heap->reserve_count < heap->reserve_low){
+    heap->reserve_wanted = 1;
+  }
+  
+  return new_chunk;
+}
+
+/*
+  Wake the background thread to refill the reserve. Called without
+  the lock of the heap, which wmalloc_premap_start takes while it
+  holds wmalloc_bg.lock.
+*/
+void request_refill(){
+
+  pthread_mutex_lock(&wmalloc_bg.lock);
+  if(wmalloc_bg.refill_requested == 0){
+    wmalloc_bg.refill_requested = 1;
+    pthread_cond_signal(&wmalloc_bg.wake);
+  }
+  pthread_mutex_unlock(&wmalloc_bg.lock);
+
+  return;
+}
+
+
+/*
+  Split the chunk if possible. 
+  Return split chunk to storage bins in proper place
+*/
+void split_chunk(struct wmalloc_info* heap, struct chunk* to_remove, uint64_t required_length){
+
+  assert(to_remove != NULL);
+  
+  if(to_remove->curr_chunk_size >= required_length + MINIMUM_CHUNK_SIZE){
+
+    uint64_t next_chunk_size = to_remove->curr_chunk_size - required_length;
+    uint64_t save_chunk_size = get_next_chunk_size(to_remove);
+
+    WMALLOC_PROBE3(split_chunk, to_remove, required_length, next_chunk_size);
+    
+    to_remove->curr_chunk_size = required_length;
+
+    char* char_ptr = (char*)to_remove;
+
+    //the size at the end of 'to_remove' lands on old contents so it
+    //is written whole rather than keeping a stale flag
+    uint64_t* ptr_to_size = (uint64_t*)(char_ptr + required_length - 8);
+    (*ptr_to_size) = next_chunk_size;
+
+    struct chunk* new_chunk = (struct chunk*)(char_ptr + to_remove->curr_chunk_size);
+    new_chunk->curr_chunk_size = next_chunk_size;
+    set_prev_chunk_size(new_chunk, to_remove->curr_chunk_size);
+    set_next_chunk_size(new_chunk, save_chunk_size);
+
+    set_available(new_chunk);
+    //the chunk after 'new_chunk' still holds the old size
+    set_adjacent_sizes(new_chunk, 1);
+    add_chunk(heap, new_chunk);
+    set_adjacent_sizes(to_remove, 1);
+  }
+
+  //the pages are about to be written, trimming has to look at them
+  //again once the chunk is freed
+  clear_purged(to_remove);
+  set_unavailable(to_remove);
+
+  return;
+}
+
+/*
+  Remove the chunk from the linked list
+*/
+struct chunk* remove_chunk(struct wmalloc_info* heap, struct chunk* to_remove){
+
+  if(heap->magic == WMALLOC_STATS_MAGIC){
+    heap->stats.bin_chunks[bin_of(heap, to_remove->curr_chunk_size)]--;
+  }
+  
+  //do not leave a next fit rover pointing at the chunk
+  if(heap->policy == WMALLOC_NEXT_FIT){
+
+    int i = bin_of(heap, to_remove->curr_chunk_size);
+    if(chunk_at(heap, heap->rover[i]) == to_remove){
+      heap->rover[i] = to_remove->right_off;
+    }
+  }
+
+  struct chunk* left_neighbor = get_left(heap, to_remove);
+  struct chunk* right_neighbor = get_right(heap, to_remove);
+
+  if(right_neighbor == NULL){
+
+    set_right(heap, left_neighbor, NULL);
+  }
+  
+  else{
+
+    set_right(heap, left_neighbor, right_neighbor);
+    set_left(heap, right_neighbor, left_neighbor);
+  }
+
+  //set 'to_remove' ptrs to NULL to avoid dangling references
+  set_right(heap, to_remove, NULL);
+  set_left(heap, to_remove, NULL);
+   
+  return to_remove;
+}
+
+/*
+  Return memory to wmalloc.
+
+  While the background thread is running the chunk is only pushed
+  onto the deferred list and the thread does the consolidation.
+  Otherwise the chunk is consolidated right away.
+*/  
+void wfree(void* to_free){
+
+  if(__builtin_expect(wmalloc_arenas.count != 0, 0)){
+    heap_free(heap_of(to_free), to_free);
+    return;
+  }
+  heap_free(wmalloc_ptr, to_free);
+  return;
+}
+
+/*
+  Return memory to the heap it was allocated from
+*/
+void heap_free(wmalloc_heap_t heap, void* to_free){
+
+  struct chunk* ch = note_free(heap, to_free);
+  
+  if(heap->defer_frees == 1){
+
+    struct chunk* head = __atomic_load_n(&heap->deferred, __ATOMIC_RELAXED);
+    do{
+      set_right(heap, ch, head);
+    }while(!__atomic_compare_exchange_n(&heap->deferred, &head, ch, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return;
+  }
+
+  lock_wmalloc(heap);
+  count_free(heap, ch);
+  free_chunk(heap, ch);
+  unlock_wmalloc(heap);
+  
+  return;
+}
+
+/*
+  The probe, hook and counters of a free. Returns the chunk of
+  'to_free'.
+*/
+struct chunk* note_free(struct wmalloc_info* heap, void* to_free){
+
+  //subtract 16 bytes from 'to_free' and cast to struct 'chunk'
+  uint64_t address = (uint64_t)(to_free);
+  address = address-16;
+
+  struct chunk* ch = (struct chunk*) address;
+
+  WMALLOC_PROBE3(wfree, heap, to_free, ch->curr_chunk_size);
+  WMALLOC_HOOK(pre_free, heap, to_free);
+
+  //wmstat reads the counters of a published heap as they change,
+  //the others are counted under the lock, see count_free
+  if(heap->magic == WMALLOC_STATS_MAGIC){
+    __atomic_add_fetch(&heap->stats.frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&heap->stats.in_use_bytes, ch->curr_chunk_size, __ATOMIC_RELAXED);
+  }
+
+  //only wmalloc_tagged sets counters up. The neighbors may rewrite
+  //the rest of the word under the lock but not the byte with the tag.
+  if(__atomic_load_n(&wmalloc_tags.threads, __ATOMIC_RELAXED) != NULL){
+
+    int tag = __atomic_load_n((uint8_t*)&ch->prev_chunk_size + TAG_SHIFT/8, __ATOMIC_RELAXED);
+    if(tag != 0){
+      count_tag(tag, -(int64_t)ch->curr_chunk_size);
+    }
+  }
+  
+  return ch;
+}
+
+/*
+  Count the free of chunk 'ch' of a heap that is not published, with
+  the lock held. note_free counts the others.
+*/
+void count_free(struct wmalloc_info* heap, struct chunk* ch){
+
+  if(heap->magic != WMALLOC_STATS_MAGIC){
+    heap->stats.frees++;
+    heap->stats.in_use_bytes = heap->stats.in_use_bytes - ch->curr_chunk_size;
+  }
+  return;
+}
+
+/*
+  If possible join the freed chunk with prev and next chunks.
+  Then return to proper bin in the linked list.
+  Returns the chunk that ended up in the bin.
+*/
+struct chunk* free_chunk(struct wmalloc_info* heap, struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  //update prev and next chunks to reflect ch new status as available
+  set_available(ch);
+
+  if(is_prev_available(ch) == 1){
+    
+    struct chunk* prev_chunk = remove_chunk(heap, get_prev_chunk(ch));
+    ch = join_chunks(prev_chunk, ch);
+    
+  }
+  if(is_next_available(ch) == 1){
+   
+    struct chunk* next_chunk = remove_chunk(heap, get_next_chunk(ch));
+    ch = join_chunks(ch, next_chunk);
+  }
+
+  add_chunk(heap, ch);
+  
+  return ch;
+}
+
+
+/*
+  Joins two chunks of memory that are adjacent
+  'first' comes first in memory followed by 'second'
+*/
+ 
+struct chunk* join_chunks(struct chunk* first, struct chunk* second){
+
+  uint64_t total_length = first->curr_chunk_size + second->curr_chunk_size;
+
+  WMALLOC_PROBE3(join_chunks, first, second, total_length);
+  first->curr_chunk_size = total_length;
+
+  //'first' may still hold pages in use
+  clear_purged(first);
+  
+  set_adjacent_sizes(first, 1);
+
+  return first;
+}
+
+/*
+  Detach the whole list of deferred frees.
+*/
+struct chunk* take_deferred(struct wmalloc_info* heap){
+
+  return __atomic_exchange_n(&heap->deferred, NULL, __ATOMIC_ACQUIRE);
+}
+
+/*
+  Consolidate every chunk on a detached deferred list.
+  The caller holds the lock.
+*/
+void free_deferred(struct wmalloc_info* heap, struct chunk* list){
+
+  while(list != NULL){
+
+    struct chunk* next = get_right(heap, list);
+    count_free(heap, list);
+    free_chunk(heap, list);
+    list = next;
+  }
+  return;
+}
+
+/*
+  Consolidate the deferred frees a batch at a time so that the lock
+  is never held for long.
+*/
+void consolidate_deferred(struct wmalloc_info* heap){
+
+  struct chunk* list = take_deferred(heap);
+
+  while(list != NULL){
+
+    lock_wmalloc(heap);
+    for(int n=0; n<DEFERRED_BATCH && list != NULL; n++){
+
+      struct chunk* next = get_right(heap, list);
+      count_free(heap, list);
+      free_chunk(heap, list);
+      list = next;
+    }
+    unlock_wmalloc(heap);
+  }
+  return;
+}
+
+
+/*
+  Give free memory back to the OS.
+
+  A free chunk with no neighbors on either side spans an entire
+  region obtained from mmap. Such chunks are unmapped, unless they
+  lie in the address range for small chunks. In every other
+  free chunk the whole pages between the bin pointers and the
+  trailing size are released with madvise and the chunk is marked as
+  purged. The pages come back zeroed when touched.
+
+  Whole regions go first, then the biggest chunks. Trimming stops
+  once no more than 'pad' bytes of free memory are held.
+
+  The lock is only held while a chunk is taken out of or put back
+  into the bins, never across the system calls. While a chunk is out
+  it is marked unavailable so its neighbors leave it alone.
+
+  Returns the number of bytes released by this call.
+*/
+uint64_t wmalloc_trim(uint64_t pad){
+
+  if(wmalloc_ptr == NULL){
+    return 0;
+  }
+
+  uint64_t released = 0;
+  for(int i=0; i<wmalloc_arenas.count; i++){
+    released = released + heap_trim(wmalloc_arenas.heap[i], pad);
+  }
+  return released + heap_trim(wmalloc_ptr, pad);
+}
+
+/*
+  wmalloc_trim for the given heap
+*/
+uint64_t heap_trim(wmalloc_heap_t heap, uint64_t pad){
+
+  consolidate_deferred(heap);
+  
+  lock_wmalloc(heap);
+  uint64_t retained = retained_bytes(heap);
+  unlock_wmalloc(heap);
+
+  uint64_t released = 0;
+  struct chunk* kept = NULL;
+  
+  while(retained > pad){
+
+    lock_wmalloc(heap);
+    
+    struct chunk* ch = find_trim_candidate(heap);
+    if(ch == NULL){
+      unlock_wmalloc(heap);
+      break;
+    }
+    
+    uint64_t held = releasable_bytes(heap, ch);
+    uint64_t chunk_size = ch->curr_chunk_size;
+    int unmap = can_unmap(heap, ch);
+    
+    remove_chunk(heap, ch);
+    set_unavailable(ch);
+    if(unmap == 1){
+      unlink_region(ch);
+    }
+    
+    unlock_wmalloc(heap);
+    
+    if(unmap == 1){
+
+      void* start = region_start(region_of(ch));
+      uint64_t region_size = region_of(ch)->size;
+      WMALLOC_HOOK(region_unmap, heap, start, region_size);
+      if(heap->arena != 0){
+        set_arena_range(start, region_size, 0);
+      }
+      munmap(start, region_size);
+      __atomic_sub_fetch(&heap->stats.mapped_bytes, region_size, __ATOMIC_RELAXED);
+      released = released + region_size;
+    }
+    else{
+
+      //madvise fails on locked pages, which then stay resident
+      uint64_t pages = release_pages(ch);
+      released = released + pages;
+
+      lock_wmalloc(heap);
+      if(pages != held){
+
+        //kept out of the bins until the trim is over so that it is
+        //not picked again
+        set_right(heap, ch, kept);
+        kept = ch;
+      }
+      else{
+
+        struct chunk* back = free_chunk(heap, ch);
+        
+        //nothing was joined so all of its pages are gone
+        if(back == ch && back->curr_chunk_size == chunk_size){
+          set_purged(back);
+        }
+      }
+      unlock_wmalloc(heap);
+    }
+
+    if(held > retained){
+      held = retained;
+    }
+    retained = retained - held;
+  }
+
+  lock_wmalloc(heap);
+  while(kept != NULL){
+    struct chunk* next = get_right(heap, kept);
+    free_chunk(heap, kept);
+    kept = next;
+  }
+  unlock_wmalloc(heap);
+  
+  return released;
+}
+
+/*
+  Returns 1 if the chunk makes up an entire mmap'd region,
+  that is it has neither a prev nor a next chunk. Otherwise 0.
+*/
+int is_whole_region(struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  if(get_prev_chunk_size(ch) == 0 && get_next_chunk_size(ch) == 0){
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if available chunk 'ch' is a whole region that trimming
+  may unmap. Regions in the address range for small chunks and
+  regions carved out of a span are kept mapped and only have their
+  pages released.
+*/
+int can_unmap(struct wmalloc_info* heap, struct chunk* ch){
+
+  if(is_whole_region(ch) == 1 && in_small_space(heap, ch) == 0 &&
+     heap->span_capacity == 0){
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if the pages of available chunk 'ch' have been released
+*/
+int is_purged(struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  uint64_t* ptr_to_size = (uint64_t*)((uint64_t)ch + ch->curr_chunk_size - 8);
+
+  if(((*ptr_to_size) & PURGED_FLAG) != 0){
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Mark the pages of available chunk 'ch' as released
+*/
+void set_purged(struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  uint64_t* ptr_to_size = (uint64_t*)((uint64_t)ch + ch->curr_chunk_size - 8);
+
+  (*ptr_to_size) = (*ptr_to_size) | PURGED_FLAG;
+  return;
+}
+
+/*
+  Mark the pages of available chunk 'ch' as possibly in use
+*/
+void clear_purged(struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  uint64_t* ptr_to_size = (uint64_t*)((uint64_t)ch + ch->curr_chunk_size - 8);
+
+  (*ptr_to_size) = (*ptr_to_size) & ~((uint64_t)PURGED_FLAG);
+  return;
+}
+
+/*
+  The number of bytes trimming would give back for available chunk
+  'ch'. A region that can be unmapped counts in full as its mapping
+  is held either way. Otherwise it is the whole pages inside the chunk, or 0 if they
+  were already purged.
+*/
+uint64_t releasable_bytes(struct wmalloc_info* heap, struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  if(can_unmap(heap, ch) == 1){
+    return ch->curr_chunk_size;
+  }
+  if(is_purged(ch) == 1){
+    return 0;
+  }
+  
+  uint64_t start = (uint64_t)ch + sizeof(struct chunk);
+  uint64_t end = (uint64_t)ch + ch->curr_chunk_size - 8;
+
+  //round start up and end down to page boundaries
+  start = (start + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+  end = end & ~((uint64_t)PAGE_SIZE - 1);
+
+  if(end <= start){
+    return 0;
+  }
+  return end - start;
+}
+
+/*
+  Total of releasable_bytes over the bins. Only bins that can hold a
+  chunk with a whole page inside are looked at.
+  The caller holds the lock.
+*/
+uint64_t retained_bytes(struct wmalloc_info* heap){
+
+  uint64_t total = 0;
+  struct chunk* curr;
+  
+  for(int i=heap->num_bins-1; i>=0 && heap->bin_index[i] > PAGE_SIZE; i--){
+
+    curr = get_right(heap, &heap->dummy[i]);
+    while(curr != NULL){
+      total = total + releasable_bytes(heap, curr);
+      curr = get_right(heap, curr);
+    }
+  }
+  return total;
+}
+
+/*
+  Find the next chunk to trim. Chunks that are whole regions are
+  preferred, then the biggest chunk that still has pages to release.
+  Returns NULL when there is nothing left to trim.
+  The caller holds the lock.
+*/
+struct chunk* find_trim_candidate(struct wmalloc_info* heap){
+
+  struct chunk* curr;
+  struct chunk* candidate = NULL;
+  
+  for(int i=heap->num_bins-1; i>=0 && heap->bin_index[i] > PAGE_SIZE; i--){
+
+    curr = get_right(heap, &heap->dummy[i]);
+    while(curr != NULL){
+
+      if(can_unmap(heap, curr) == 1){
+        return curr;
+      }
+      if(candidate == NULL && releasable_bytes(heap, curr) != 0){
+        candidate = curr;
+      }
+      curr = get_right(heap, curr);
+    }
+  }
+  return candidate;
+}
+
+/*
+  madvise away the whole pages inside an available chunk. The chunk
+  header with the bin pointers and the size at the end of the chunk
+  are left untouched.
+
+  Returns the number of bytes released.
+*/
+uint64_t release_pages(struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  uint64_t start = (uint64_t)ch + sizeof(struct chunk);
+  uint64_t end = (uint64_t)ch + ch->curr_chunk_size - 8;
+
+  //round start up and end down to page boundaries
+  start = (start + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+  end = end & ~((uint64_t)PAGE_SIZE - 1);
+
+  if(end <= start){
+    return 0;
+  }
+
+  if(madvise((void*)start, end - start, MADV_DONTNEED) == -1){
+    return 0;
+  }
+  
+  return end - start;
+}
+
+
+/*
+  Start the background maintenance thread.
+
+  Every 'interval_ms' the thread consolidates the frees that wfree
+  has deferred to it and purges free pages. Roughly interval/decay
+  of the held free memory is released on each pass, so pages idle
+  for about 'decay_ms' are given back. A decay of 0 releases
+  everything on each pass. Empty regions are unmapped along the way.
+
+  While the thread runs wfree only pushes the chunk onto a list and
+  wmalloc only takes an uncontended lock.
+
+  Returns -1 if the thread could not be started.
+*/
+int wmalloc_background_start(uint64_t interval_ms, uint64_t decay_ms){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&wmalloc_bg.lock);
+  
+  wmalloc_bg.interval_ms = interval_ms;
+  wmalloc_bg.decay_ms = decay_ms;
+  wmalloc_bg.maintain = 1;
+  clock_gettime(CLOCK_REALTIME, &wmalloc_bg.next_pass);
+
+  if(start_background_thread() == -1){
+    wmalloc_bg.maintain = 0;
+    pthread_mutex_unlock(&wmalloc_bg.lock);
+    return -1;
+  }
+  wmalloc_ptr->defer_frees = 1;
+  
+  pthread_mutex_unlock(&wmalloc_bg.lock);
+  
+  return 1;
+}
+
+/*
+  Keep a reserve of premapped regions so that wmalloc
+  does not have to call mmap when the bins run dry.
+
+  The background thread maps regions until 'high' are waiting and
+  maps more whenever wmalloc takes the reserve below 'low'. With
+  WMALLOC_PREMAP_POPULATE in 'flags' the regions are faulted in
+  ahead of time as well.
+
+  Returns -1 if the thread could not be started or the default heap
+  lies in a span, see wmalloc_init_with_buffer.
+*/
+int wmalloc_premap_start(int low, int high, int flags){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  //regions for a span are carved from it, not mapped
+  if(wmalloc_ptr->span_capacity != 0){
+    printf("wmalloc: no premapped regions for a heap in a span\n");
+    return -1;
+  }
+  
+  if(high < low){
+    high = low;
+  }
+
+  //the heap lock is never taken inside wmalloc_bg.lock, wmalloc holds
+  //it when it asks for a refill
+  lock_wmalloc(wmalloc_ptr);
+  wmalloc_ptr->reserve_low = low;
+  wmalloc_ptr->reserve_high = high;
+  wmalloc_ptr->reserve_flags = flags;
+  unlock_wmalloc(wmalloc_ptr);
+  
+  pthread_mutex_lock(&wmalloc_bg.lock);
+
+  if(start_background_thread() == -1){
+    pthread_mutex_unlock(&wmalloc_bg.lock);
+    return -1;
+  }
+  
+  wmalloc_bg.premap = 1;
+  wmalloc_bg.refill_requested = 1;
+  pthread_cond_signal(&wmalloc_bg.wake);
+  
+  pthread_mutex_unlock(&wmalloc_bg.lock);
+
+  return 1;
+}
+
+/*
+  Stop the background thread and consolidate whatever frees are still
+  deferred. Regions left in the reserve are still used by wmalloc.
+  The bins stay locked from here on.
+*/
+void wmalloc_background_stop(){
+
+  pthread_mutex_lock(&wmalloc_bg.lock);
+  
+  if(wmalloc_bg.running == 0){
+    pthread_mutex_unlock(&wmalloc_bg.lock);
+    return;
+  }
+  
+  wmalloc_ptr->defer_frees = 0;
+  wmalloc_bg.running = 0;
+  wmalloc_bg.maintain = 0;
+  wmalloc_bg.premap = 0;
+  pthread_cond_signal(&wmalloc_bg.wake);
+  pthread_mutex_unlock(&wmalloc_bg.lock);
+
+  pthread_join(wmalloc_bg.thread, NULL);
+
+  consolidate_deferred(wmalloc_ptr);
+  
+  return;
+}
+
+/*
+  Create the background thread if it is not running yet.
+  The caller holds wmalloc_bg.lock.
+  Returns -1 if the thread could not be created.
+*/
+int start_background_thread(){
+
+  if(wmalloc_bg.running == 1){
+    pthread_cond_signal(&wmalloc_bg.wake);
+    return 1;
+  }
+  
+  //from here on the bins are shared with the thread
+  wmalloc_ptr->threaded = 1;
+  wmalloc_bg.running = 1;
+  
+  if(pthread_create(&wmalloc_bg.thread, NULL, background_main, NULL) != 0){
+
+    wmalloc_bg.running = 0;
+    return -1;
+  }
+  return 1;
+}
+
+/*
+  The loop of the background thread. Sleeps until the next pass is
+  due or wmalloc asks for the reserve to be refilled.
+*/
+void* background_main(void* arg){
+
+  (void)arg;
+  
+  pthread_mutex_lock(&wmalloc_bg.lock);
+
+  while(wmalloc_bg.running == 1){
+
+    if(wmalloc_bg.refill_requested == 0){
+
+      if(wmalloc_bg.maintain == 1){
+        pthread_cond_timedwait(&wmalloc_bg.wake, &wmalloc_bg.lock, &wmalloc_bg.next_pass);
+      }
+      else{
+        pthread_cond_wait(&wmalloc_bg.wake, &wmalloc_bg.lock);
+      }
+    }
+
+    if(wmalloc_bg.running == 0){
+      break;
+    }
+
+    int premap = wmalloc_bg.premap;
+    int watch = wmalloc_pressure.watch;
+    wmalloc_bg.refill_requested = 0;
+
+    //work out whether a pass is due and when the next one is
+    int pass_due = 0;
+    if(wmalloc_bg.maintain == 1){
+
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+
+      if(now.tv_sec > wmalloc_bg.next_pass.tv_sec ||
+         (now.tv_sec == wmalloc_bg.next_pass.tv_sec &&
+          now.tv_nsec >= wmalloc_bg.next_pass.tv_nsec)){
+
+        pass_due = 1;
+        
+        uint64_t nsec = now.tv_nsec + (wmalloc_bg.interval_ms%1000)*1000000;
+        wmalloc_bg.next_pass.tv_sec = now.tv_sec + wmalloc_bg.interval_ms/1000 + nsec/1000000000;
+        wmalloc_bg.next_pass.tv_nsec = nsec%1000000000;
+      }
+    }
+    
+    pthread_mutex_unlock(&wmalloc_bg.lock);
+
+    if(premap == 1){
+      refill_reserve();
+    }
+    if(pass_due == 1){
+      background_pass(watch);
+    }
+    
+    pthread_mutex_lock(&wmalloc_bg.lock);
+  }
+
+  pthread_mutex_unlock(&wmalloc_bg.lock);
+  
+  return NULL;
+}
+
+/*
+  One pass of the background maintenance thread. Under memory
+  pressure the decay is cut short, see wmalloc_pressure_watch.
+*/
+void background_pass(int watch){
+
+  consolidate_deferred(wmalloc_ptr);
+
+  uint64_t decay_ms = wmalloc_bg.decay_ms;
+  if(watch == 1){
+
+    int level = read_pressure_level();
+    __atomic_store_n(&wmalloc_pressure.level, level, __ATOMIC_RELAXED);
+    
+    decay_ms = decay_ms*(100 - level)/100;
+    if(level == 100){
+      release_reserve();
+    }
+  }
+  
+  //each arena keeps a share of what it retains itself
+  for(int i=0; i<wmalloc_arenas.count; i++){
+    decay_heap(wmalloc_arenas.heap[i], decay_ms);
+  }
+  decay_heap(wmalloc_ptr, decay_ms);
+  
+  return;
+}
+
+/*
+  Release the part of what 'heap' retains that has been idle for
+  about 'decay_ms', one interval's worth of it
+*/
+void decay_heap(struct wmalloc_info* heap, uint64_t decay_ms){
+
+  lock_wmalloc(heap);
+  uint64_t retained = retained_bytes(heap);
+  unlock_wmalloc(heap);
+
+  //keep the part that has not been idle long enough
+  uint64_t pad = 0;
+  if(decay_ms > wmalloc_bg.interval_ms){
+    pad = retained - retained/decay_ms*wmalloc_bg.interval_ms;
+  }
+  
+  heap_trim(heap, pad);
+  
+  return;
+}
+
+/*
+  Map regions until the reserve holds reserve_high of them, unless
+  memory pressure is full.
+  The mmap calls are made without holding the lock.
+*/
+void refill_reserve(){
+
+  while(1){
+
+    lock_wmalloc(wmalloc_ptr);
+    int needed = wmalloc_ptr->reserve_count < wmalloc_ptr->reserve_high;
+    int flags = wmalloc_ptr->reserve_flags;
+    unlock_wmalloc(wmalloc_ptr);
+
+    if(needed == 0 || wmalloc_memory_pressure() == 100){
+      break;
+    }
+
+    struct chunk* new_chunk = map_region(wmalloc_ptr, wmalloc_conf.region_size, flags | MAP_COLOUR);
+    if(new_chunk == NULL){
+      break;
+    }
+
+    lock_wmalloc(wmalloc_ptr);
+    link_region(wmalloc_ptr, new_chunk);
+    set_right(wmalloc_ptr, new_chunk, wmalloc_ptr->reserve);
+    wmalloc_ptr->reserve = new_chunk;
+    wmalloc_ptr->reserve_count++;
+    unlock_wmalloc(wmalloc_ptr);
+  }
+  return;
+}
+
+
+/*
+  Create a heap of its own with its own bins and regions. Memory from
+  it is allocated with heap_alloc, returned with heap_free and all of
+  it is unmapped at once with heap_destroy.
+
+  A new heap starts with the bin layout and placement policy of the
+  default heap. It takes its lock on every call so it may be shared
+  between threads.
+
+  With WMALLOC_COMPACT the heap is a cage, see wmalloc_cage_create.
+  Returns NULL if the heap could not be set up.
+*/
+wmalloc_heap_t heap_create(){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return NULL;
+    }
+  }
+
+#ifdef WMALLOC_COMPACT
+  return wmalloc_cage_create();
+#endif
+  
+  void* mmap_ptr = mmap(NULL, sizeof(struct wmalloc_info), PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(mmap_ptr == (void*) -1){
+    return NULL;
+  }
+
+  struct wmalloc_info* heap = (struct wmalloc_info*) mmap_ptr;
+  initialize_heap(heap);
+
+  lock_wmalloc(wmalloc_ptr);
+  for(int i=0; i<NUM_BINS; i++){
+    heap->bin_index[i] = wmalloc_ptr->bin_index[i];
+  }
+  heap->num_bins = wmalloc_ptr->num_bins;
+  heap->policy = wmalloc_ptr->policy;
+  unlock_wmalloc(wmalloc_ptr);
+  
+  heap->threaded = 1;
+  
+  return heap;
+}
+
+/*
+  Unmap every region of the heap in one pass, along with the heap
+  itself. Whatever was allocated from it is gone. The default heap
+  cannot be destroyed. A cage is unmapped whole.
+*/
+void heap_destroy(wmalloc_heap_t heap){
+
+  if(heap != NULL && heap != wmalloc_ptr){
+    drop_region_index(heap);
+  }
+  
+  if(heap != NULL && heap != wmalloc_ptr && heap->magic == WMALLOC_CAGE_MAGIC){
+    wmalloc_cage_destroy(heap);
+    return;
+  }
+  
+  if(heap == NULL || heap == wmalloc_ptr || heap->span_capacity != 0){
+    printf("wmalloc: heap_destroy needs a heap from heap_create\n");
+    return;
+  }
+
+  struct region* curr = heap->regions.next;
+  while(curr != &heap->regions){
+
+    struct region* next = curr->next;
+    WMALLOC_HOOK(region_unmap, heap, region_start(curr), curr->size);
+    munmap(region_start(curr), curr->size);
+    curr = next;
+  }
+
+  if(heap->small_base != 0){
+    if(heap->small_top != heap->small_base){
+      WMALLOC_HOOK(region_unmap, heap, (void*)heap->small_base, heap->small_top - heap->small_base);
+    }
+    munmap((void*)heap->small_base, SMALL_SPACE_SIZE);
+  }
+  if(heap->learn_hist != NULL){
+    munmap(heap->learn_hist, (LEARN_LIMIT/8+1)*sizeof(uint32_t));
+  }
+
+  pthread_mutex_destroy(&heap->lock);
+  munmap(heap, sizeof(struct wmalloc_info));
+  
+  return;
+}
+
+/*
+  Returns the header of the region that chunk 'ch' starts. Only valid
+  for the first chunk of a region.
+*/
+struct region* region_of(struct chunk* ch){
+
+  assert(ch != NULL);
+  
+  return ((struct region*) ch) - 1;
+}
+
+/*
+  Add the region that starts with chunk 'ch' to the regions of the
+  heap.
+  The caller holds the lock.
+*/
+void link_region(struct wmalloc_info* heap, struct chunk* ch){
+
+  struct region* new_region = region_of(ch);
+
+  new_region->next = heap->regions.next;
+  new_region->prev = &heap->regions;
+  heap->regions.next->prev = new_region;
+  heap->regions.next = new_region;
+  
+  return;
+}
+
+/*
+  Take the region that starts with chunk 'ch' off the regions of its
+  heap before it is unmapped.
+  The caller holds the lock.
+*/
+void unlink_region(struct chunk* ch){
+
+  struct region* old_region = region_of(ch);
+
+  old_region->prev->next = old_region->next;
+  old_region->next->prev = old_region->prev;
+  
+  return;
+}
+
+/*
+  Returns the offset of 'ptr' within the heap, or 0 for NULL.
+  For a persistent or shared heap the offset is the same in every
+  mapping of it, so it is what should be stored in the heap or handed
+  to another process in place of a pointer.
+*/
+uint64_t heap_offset(wmalloc_heap_t heap, void* ptr){
+
+  if(ptr == NULL){
+    return 0;
+  }
+  return (uint64_t)ptr - (uint64_t)heap;
+}
+
+/*
+  Returns the pointer for an offset from heap_offset
+*/
+void* heap_pointer(wmalloc_heap_t heap, uint64_t offset){
+
+  if(offset == 0){
+    return NULL;
+  }
+  return (void*) ((uint64_t)heap + offset);
+}
+
+/*
+  Set up a new heap at the start of a mapping of 'capacity' bytes.
+  The regions are carved from SPAN_FIRST_REGION on. Like heap_create
+  it starts with the bin layout and policy of the default heap.
+  With WMALLOC_COMPACT no more than WMALLOC_CAGE_SIZE of the mapping
+  is used.
+*/
+void initialize_span_heap(struct wmalloc_info* heap, uint64_t capacity){
+
+  uint64_t length = capacity;
+  
+#ifdef WMALLOC_COMPACT
+  if(capacity > WMALLOC_CAGE_SIZE){
+    capacity = WMALLOC_CAGE_SIZE;
+  }
+#endif
+  
+  initialize_heap(heap);
+  
+  lock_wmalloc(wmalloc_ptr);
+  for(int i=0; i<NUM_BINS; i++){
+    heap->bin_index[i] = wmalloc_ptr->bin_index[i];
+  }
+  heap->num_bins = wmalloc_ptr->num_bins;
+  heap->policy = wmalloc_ptr->policy;
+  unlock_wmalloc(wmalloc_ptr);
+
+  //there is no address range for small chunks in the span
+  if(heap->policy == WMALLOC_SEGREGATED){
+    heap->policy = WMALLOC_BEST_FIT;
+  }
+
+  heap->span_top = SPAN_FIRST_REGION;
+  heap->span_capacity = capacity;
+  heap->span_length = length;
+  heap->stats.mapped_bytes = SPAN_FIRST_REGION;
+  heap->threaded = 1;
+  
+  return;
+}
+
+
+/*
+  Open the persistent heap kept in the file at 'path', creating it if
+  the file is empty or missing.
+
+  Everything about the heap lives in the file: the bins with their
+  dummy nodes, the boundary tags and the chunks themselves. The links
+  between chunks are offsets from the start of the file so the bins
+  are ready as soon as the file is mapped again, with nothing to
+  rebuild. The file is mapped at the address it had last time when
+  that is free. Pointers kept in the heap by the program should be
+  stored as offsets with heap_offset to be safe either way.
+  The object the rest is found from is set with wmalloc_pheap_set_root.
+
+  The file grows by a region at a time up to PHEAP_CAPACITY. Only one
+  process may have a file open at a time, and a file is only
+  consistent once wmalloc_pheap_close has synced it.
+
+  Allocate with heap_alloc and free with heap_free.
+  Returns NULL if the file cannot be opened or holds something else.
+*/
+wmalloc_heap_t wmalloc_pheap_open(const char* path){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return NULL;
+    }
+  }
+  
+  int fd = open(path, O_RDWR|O_CREAT, 0600);
+  if(fd == -1){
+    return NULL;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) == -1){
+    close(fd);
+    return NULL;
+  }
+
+  //the magic, info size and last address at the start of an existing
+  //file
+  uint64_t saved[3] = {0, 0, 0};
+  int fresh = st.st_size == 0;
+  
+  if(fresh == 0){
+    
+    if(pread(fd, saved, sizeof(saved), 0) != sizeof(saved) ||
+       saved[0] != WMALLOC_PHEAP_MAGIC || saved[1] != sizeof(struct wmalloc_info)){
+
+      printf("wmalloc: %s is not a persistent heap\n", path);
+      close(fd);
+      return NULL;
+    }
+  }
+  
+  void* space = mmap((void*)saved[2], PHEAP_CAPACITY, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(space == (void*) -1){
+    close(fd);
+    return NULL;
+  }
+
+  struct wmalloc_info* heap = (struct wmalloc_info*) space;
+  
+  if(fresh == 1){
+
+    if(ftruncate(fd, SPAN_FIRST_REGION) == -1){
+      munmap(space, PHEAP_CAPACITY);
+      close(fd);
+      return NULL;
+    }
+    
+    initialize_span_heap(heap, PHEAP_CAPACITY);
+    heap->magic = WMALLOC_PHEAP_MAGIC;
+  }
+  else{
+
+    //the lock was left in whatever state the last process had it
+    pthread_mutex_init(&heap->lock, NULL);
+  }
+
+  //state that only means something to the process that set it
+  heap->mapped_at = (uint64_t)heap;
+  heap->span_fd = fd;
+  heap->threaded = 1;
+  heap->defer_frees = 0;
+  heap->deferred = NULL;
+  heap->reserve = NULL;
+  heap->reserve_count = 0;
+  heap->reserve_wanted = 0;
+  heap->learn_hist = NULL;
+  heap->learn_remaining = 0;
+  heap->regions.next = &heap->regions;
+  heap->regions.prev = &heap->regions;
+  
+  return heap;
+}
+
+/*
+  Sync a persistent heap to its file and unmap it. Whatever was
+  allocated from it stays in the file for the next open.
+*/
+void wmalloc_pheap_close(wmalloc_heap_t heap){
+
+  if(heap == NULL || heap->span_fd == -1){
+    printf("wmalloc: wmalloc_pheap_close needs a heap from wmalloc_pheap_open\n");
+    return;
+  }
+
+  lock_wmalloc(heap);
+  msync(heap, heap->span_top, MS_SYNC);
+  int fd = heap->span_fd;
+  unlock_wmalloc(heap);
+
+  pthread_mutex_destroy(&heap->lock);
+  //the whole of what wmalloc_pheap_open mapped, the span may be less
+  munmap(heap, PHEAP_CAPACITY);
+  close(fd);
+  
+  return;
+}
+
+/*
+  Remember 'root' as the object to start from when the persistent
+  heap is opened again. NULL clears it.
+*/
+void wmalloc_pheap_set_root(wmalloc_heap_t heap, void* root){
+
+  lock_wmalloc(heap);
+  heap->root = heap_offset(heap, root);
+  unlock_wmalloc(heap);
+  
+  return;
+}
+
+/*
+  Returns the object set with wmalloc_pheap_set_root, or NULL
+*/
+void* wmalloc_pheap_root(wmalloc_heap_t heap){
+
+  lock_wmalloc(heap);
+  uint64_t root = heap->root;
+  unlock_wmalloc(heap);
+  
+  return heap_pointer(heap, root);
+}
+
+/*
+  Carve a region of 'length' bytes off the top of the span of the
+  heap and set it up as a single chunk like map_region does. The file
+  behind a persistent heap is grown to cover it. A shared heap is
+  sized in full up front.
+  Returns NULL once the span is used up.
+  The caller holds the lock.
+*/
+struct chunk* carve_region(struct wmalloc_info* heap, uint64_t length){
+
+  if(heap->span_top + length > heap->span_capacity){
+    return NULL;
+  }
+
+  if(heap->span_fd != -1 && ftruncate(heap->span_fd, heap->span_top + length) == -1){
+    return NULL;
+  }
+  
+  struct region* new_region = (struct region*) ((uint64_t)heap + heap->span_top);
+  new_region->size = length;
+  new_region->next = NULL;
+  new_region->prev = NULL;
+  //the regions of a span are found by their sizes from the start of
+  //the span, so they are not coloured
+  new_region->colour = 0;
+
+  heap->span_top = heap->span_top + length;
+  __atomic_add_fetch(&heap->stats.mapped_bytes, length, __ATOMIC_RELAXED);
+  WMALLOC_HOOK(region_map, heap, new_region, length);
+  
+  struct chunk* new_chunk = (struct chunk*) (new_region + 1);
+    
+  set_prev_chunk_size(new_chunk, 0);
+  new_chunk -> curr_chunk_size = length - sizeof(struct region);
+  //a buffer may hold old contents, so no flag is kept
+  *(uint64_t*)((uint64_t)new_chunk + new_chunk->curr_chunk_size - 8) = 0;
+  
+  return new_chunk;
+}
+
+/*
+  Create a heap in shared memory that several processes can allocate
+  from and free to.
+
+  With a 'name' the heap is a POSIX shared memory object that other
+  processes open with wmalloc_shared_attach. Without one it is an
+  anonymous memfd segment that is shared with the children forked
+  after this call, at the same address.
+
+  The segment is 'capacity' bytes. Pages are only backed once they
+  are used. Each process may map the heap at a different address so
+  the links in the bins are offsets, and a buffer is passed to
+  another process as its heap_offset. The lock is process shared and
+  robust. If a process dies while holding it, the next one to lock
+  takes over. The heap may be left inconsistent in that case.
+
+  Returns NULL if the segment cannot be created or mapped.
+*/
+wmalloc_heap_t wmalloc_shared_create(const char* name, uint64_t capacity){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return NULL;
+    }
+  }
+
+  //room for the info and at least one region
+  uint64_t minimum = SPAN_FIRST_REGION + wmalloc_conf.region_size;
+  if(capacity < minimum){
+    capacity = minimum;
+  }
+  capacity = (capacity + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+  
+  int fd;
+  if(name == NULL){
+    fd = syscall(SYS_memfd_create, "wmalloc", 0);
+  }
+  else{
+    fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+  }
+  if(fd == -1){
+    return NULL;
+  }
+
+  void* space = (void*) -1;
+  if(ftruncate(fd, capacity) != -1){
+    space = mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  
+  if(space == (void*) -1){
+    if(name != NULL){
+      shm_unlink(name);
+    }
+    return NULL;
+  }
+
+  struct wmalloc_info* heap = (struct wmalloc_info*) space;
+  initialize_span_heap(heap, capacity);
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_destroy(&heap->lock);
+  pthread_mutex_init(&heap->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  //attaching processes check for the magic
+  __atomic_store_n(&heap->magic, WMALLOC_SHARED_MAGIC, __ATOMIC_RELEASE);
+  
+  return heap;
+}
+
+/*
+  Map the shared heap created with wmalloc_shared_create under 'name'
+  into this process.
+  Returns NULL if there is no such heap.
+*/
+wmalloc_heap_t wmalloc_shared_attach(const char* name){
+
+  int fd = shm_open(name, O_RDWR, 0);
+  if(fd == -1){
+    return NULL;
+  }
+  
+  struct stat st;
+  void* space = (void*) -1;
+  
+  if(fstat(fd, &st) != -1 && (uint64_t)st.st_size >= sizeof(struct wmalloc_info)){
+    space = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if(space == (void*) -1){
+    return NULL;
+  }
+
+  struct wmalloc_info* heap = (struct wmalloc_info*) space;
+
+  if(__atomic_load_n(&heap->magic, __ATOMIC_ACQUIRE) != WMALLOC_SHARED_MAGIC ||
+     heap->info_size != sizeof(struct wmalloc_info)){
+
+    printf("wmalloc: %s is not a shared heap\n", name);
+    munmap(space, st.st_size);
+    return NULL;
+  }
+  
+  return heap;
+}
+
+/*
+  Unmap a shared heap from this process. The heap lives on for the
+  other processes. A named heap is removed with shm_unlink once no
+  process needs to attach to it any more.
+*/
+void wmalloc_shared_detach(wmalloc_heap_t heap){
+
+  if(heap == NULL || heap->magic != WMALLOC_SHARED_MAGIC){
+    printf("wmalloc: wmalloc_shared_detach needs a shared heap\n");
+    return;
+  }
+  
+  munmap(heap, heap->span_length);
+  
+  return;
+}
+
+/*
+  Run wmalloc and wfree over the 'length' bytes at 'buffer', a locked
+  hugepage region for example, instead of memory from the OS. The
+  bins, chunks and policies are the same, the regions are carved out
+  of the buffer one after the other and nothing calls mmap. Once the
+  buffer is used up wmalloc returns NULL with errno set to ENOMEM, at
+  the same point for the same requests every run.
+
+  The buffer holds the info of the heap at its start. The background
+  thread, premapping, learning and arenas are not started from
+  WMALLOC_CONF in this mode, as they would call into the OS.
+
+  Has to come before the first call to wmalloc.
+  Returns -1 if wmalloc was in use already or the buffer is too small.
+*/
+int wmalloc_init_with_buffer(void* buffer, uint64_t length){
+
+  if(wmalloc_ptr != NULL){
+    printf("wmalloc: wmalloc_init_with_buffer has to come before the first wmalloc\n");
+    return -1;
+  }
+
+  uint64_t start = ((uint64_t)buffer + 63) & ~((uint64_t)63);
+  uint64_t skipped = start - (uint64_t)buffer;
+
+  if(length < skipped + SPAN_FIRST_REGION + PAGE_SIZE){
+    printf("wmalloc: a buffer of %lu bytes is too small\n", length);
+    return -1;
+  }
+  
+  struct wmalloc_info* heap = (struct wmalloc_info*) start;
+  initialize_heap(heap);
+  initialize_bin_indices(heap);
+  
+  read_config(heap, getenv("WMALLOC_CONF"));
+  heap->policy = wmalloc_conf.policy;
+
+  //there is no address range for small chunks in the buffer
+  if(heap->policy == WMALLOC_SEGREGATED){
+    heap->policy = WMALLOC_BEST_FIT;
+  }
+
+  heap->span_top = SPAN_FIRST_REGION;
+  heap->span_capacity = length - skipped;
+  heap->span_length = length - skipped;
+#ifdef WMALLOC_COMPACT
+  if(heap->span_capacity > WMALLOC_CAGE_SIZE){
+    heap->span_capacity = WMALLOC_CAGE_SIZE;
+  }
+#endif
+  heap->stats.mapped_bytes = SPAN_FIRST_REGION;
+  heap->threaded = 1;
+
+  wmalloc_ptr = heap;
+  
+  return 1;
+}
+
+/*
+  Map 'bytes' up front and put them in the bins of the heap this
+  thread allocates from, so the first requests after startup neither
+  call mmap nor fault. See heap_reserve.
+*/
+int wmalloc_reserve(uint64_t bytes, int flags){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  if(wmalloc_arenas.count != 0){
+    return heap_reserve(thread_arena(), bytes, flags);
+  }
+  return heap_reserve(wmalloc_ptr, bytes, flags);
+}
+
+/*
+  Map a region of at least 'bytes' for 'heap' and add it to the bins
+  as one available chunk that requests are split off.
+
+  With WMALLOC_RESERVE_POPULATE the pages are faulted in by mmap,
+  with WMALLOC_RESERVE_TOUCH they are written to one by one instead,
+  which places them by the memory policy of the calling thread, and
+  with WMALLOC_RESERVE_LOCK they are locked in memory. A lock that
+  fails is reported and the memory is reserved anyway.
+
+  The region is given back like any other by wmalloc_trim, and the
+  background thread purges its pages once they are idle for longer
+  than the decay.
+  Returns -1 if the region cannot be mapped.
+*/
+int heap_reserve(wmalloc_heap_t heap, uint64_t bytes, int flags){
+
+  if(heap->span_capacity != 0){
+    printf("wmalloc: a heap in a span has its memory already\n");
+    return -1;
+  }
+  
+  uint64_t length = ((bytes + sizeof(struct region) + PAGE_SIZE - 1)/PAGE_SIZE)*PAGE_SIZE;
+  if(heap->arena != 0){
+    length = (length + ARENA_GRANULE - 1) & ~((uint64_t)ARENA_GRANULE - 1);
+  }
+
+  struct chunk* new_chunk = map_region(heap, length, flags & WMALLOC_RESERVE_POPULATE);
+  if(new_chunk == NULL){
+    return -1;
+  }
+  void* new_region = region_start(region_of(new_chunk));
+
+  if((flags & WMALLOC_RESERVE_LOCK) != 0 && mlock(new_region, length) == -1){
+    printf("wmalloc: could not lock %lu reserved bytes\n", length);
+  }
+
+  if((flags & WMALLOC_RESERVE_TOUCH) != 0){
+
+    volatile char* page = (volatile char*) new_region;
+    for(uint64_t offset = PAGE_SIZE; offset < length; offset = offset + PAGE_SIZE){
+      page[offset] = 0;
+    }
+  }
+
+  lock_wmalloc(heap);
+  link_region(heap, new_chunk);
+  free_chunk(heap, new_chunk);
+  unlock_wmalloc(heap);
+  
+  return 1;
+}
+
+/*
+  Publish the counters of the default heap for wmstat to read.
+
+  The info of the default heap, counters and bin layout included, is
+  moved into a POSIX shared memory segment named /wmalloc.<pid>.
+  wfree then updates the counters with relaxed atomics, as it does
+  not hold the lock, and no lock is taken for the reader. The segment is removed when the program exits.
+
+  Has to be called before anything is allocated, which is what
+  WMALLOC_CONF="stats:1" does. Children forked afterwards keep their
+  counters to themselves.
+
+  Returns -1 if the heap is in use already or the segment cannot be
+  created.
+*/
+int wmalloc_stats_publish(){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+  
+  if(wmalloc_ptr->magic == WMALLOC_STATS_MAGIC){
+    return 1;
+  }
+  if(wmalloc_ptr->stats.mapped_bytes != 0 || wmalloc_ptr->threaded == 1){
+    return -1;
+  }
+  
+  char name[32];
+  stats_segment_name(name, getpid());
+  
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if(fd == -1){
+    return -1;
+  }
+
+  void* space = (void*) -1;
+  if(ftruncate(fd, SPAN_FIRST_REGION) != -1){
+    space = mmap(NULL, SPAN_FIRST_REGION, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if(space == (void*) -1){
+    shm_unlink(name);
+    return -1;
+  }
+
+  //nothing is linked to the old info yet but the empty region list
+  struct wmalloc_info* heap = (struct wmalloc_info*) space;
+  memcpy(heap, wmalloc_ptr, sizeof(struct wmalloc_info));
+  heap->regions.next = &heap->regions;
+  heap->regions.prev = &heap->regions;
+  
+  wmalloc_ptr = heap;
+  
+  atexit(unlink_stats_segment);
+  pthread_atfork(stats_fork_prepare, stats_fork_parent, stats_fork_child);
+
+  //wmstat checks for the magic
+  __atomic_store_n(&heap->magic, WMALLOC_STATS_MAGIC, __ATOMIC_RELEASE);
+  
+  return 1;
+}
+
+/*
+  The name of the stats segment of process 'pid'
+*/
+void stats_segment_name(char* name, int pid){
+
+  sprintf(name, "/wmalloc.%d", pid);
+  return;
+}
+
+/*
+  Remove the stats segment of this process at exit
+*/
+void unlink_stats_segment(){
+
+  if(wmalloc_ptr != NULL && wmalloc_ptr->magic == WMALLOC_STATS_MAGIC){
+    
+    char name[32];
+    stats_segment_name(name, getpid());
+    shm_unlink(name);
+  }
+  return;
+}
+
+/*
+  The bins are not touched while a published process forks
+*/
+void stats_fork_prepare(){
+
+  lock_wmalloc(wmalloc_ptr);
+  return;
+}
+
+void stats_fork_parent(){
+
+  unlock_wmalloc(wmalloc_ptr);
+  return;
+}
+
+/*
+  The child would share the bins of its parent through the segment.
+  Give it a private copy at the same address instead.
+*/
+void stats_fork_child(){
+
+  struct wmalloc_info* heap = wmalloc_ptr;
+  char copy[SPAN_FIRST_REGION];
+
+  memcpy(copy, heap, SPAN_FIRST_REGION);
+  mmap(heap, SPAN_FIRST_REGION, PROT_READ|PROT_WRITE,
+       MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+  memcpy(heap, copy, SPAN_FIRST_REGION);
+
+  heap->magic = 0;
+  unlock_wmalloc(heap);
+  
+  return;
+}
+
+/*
+  Install the hooks in 'hooks' for every heap, or remove them with
+  NULL. The hooks are copied.
+
+  Install them before the threads that allocate are started. A hook
+  removed while another thread is in wmalloc may still be called once
+  by that thread, so what 'arg' points to has to outlive the call.
+*/
+int wmalloc_set_hooks(const struct wmalloc_hooks* hooks){
+
+  __atomic_store_n(&hooks_enabled, 0, __ATOMIC_RELEASE);
+
+  if(hooks == NULL){
+    return 1;
+  }
+
+  installed_hooks = *hooks;
+  __atomic_store_n(&hooks_enabled, 1, __ATOMIC_RELEASE);
+  
+  return 1;
+}
+
+/*
+  Allocate like wmalloc and count the chunk towards 'tag' until it is
+  freed. Tags go from 1 to WMALLOC_TAGS-1.
+
+  Returns NULL without touching the heap when the tag has a limit
+  that the request would go over. The limit is soft: threads
+  allocating at the same time can each get under it together.
+
+  The first call shares the default heap between threads, so it has
+  to come before other threads are started.
+*/
+void* wmalloc_tagged(uint64_t request_length, int tag){
+
+  if(tag <= 0 || tag >= WMALLOC_TAGS){
+    printf("wmalloc: tag %d is not between 1 and %d\n", tag, WMALLOC_TAGS-1);
+    return NULL;
+  }
+
+  uint64_t limit = __atomic_load_n(&wmalloc_tags.limit[tag], __ATOMIC_RELAXED);
+  if(limit != 0 && wmalloc_tag_usage(tag) + request_length > limit){
+    return NULL;
+  }
+  
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      printf("ERROR in Initializing malloc\n\n");
+      return NULL;
+    }
+  }
+
+  if(wmalloc_arenas.count != 0){
+    return tagged_alloc(thread_arena(), request_length, tag);
+  }
+  return tagged_alloc(wmalloc_ptr, request_length, tag);
+}
+
+/*
+  Set the soft limit in bytes for 'tag', 0 removes it
+*/
+int wmalloc_tag_limit(int tag, uint64_t limit){
+
+  if(tag <= 0 || tag >= WMALLOC_TAGS){
+    printf("wmalloc: tag %d is not between 1 and %d\n", tag, WMALLOC_TAGS-1);
+    return -1;
+  }
+
+  __atomic_store_n(&wmalloc_tags.limit[tag], limit, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+  Returns the bytes held by chunks with 'tag', overhead included.
+  Adds up the counters of every thread without a lock.
+*/
+uint64_t wmalloc_tag_usage(int tag){
+
+  if(tag <= 0 || tag >= WMALLOC_TAGS){
+    return 0;
+  }
+  
+  int64_t total = 0;
+  
+  struct tag_counters* curr = __atomic_load_n(&wmalloc_tags.threads, __ATOMIC_ACQUIRE);
+  while(curr != NULL){
+    total = total + __atomic_load_n(&curr->live[tag], __ATOMIC_RELAXED);
+    curr = curr->next;
+  }
+
+  //a thread can be caught between an allocation and a free
+  if(total < 0){
+    return 0;
+  }
+  return total;
+}
+
+/*
+  Add 'bytes' to the counter of 'tag' of this thread
+*/
+void count_tag(int tag, int64_t bytes){
+
+  struct tag_counters* counters = my_tag_counters;
+  if(counters == NULL){
+    counters = thread_tag_counters();
+    if(counters == NULL){
+      return;
+    }
+  }
+
+  //only this thread writes them
+  int64_t live = counters->live[tag] + bytes;
+  __atomic_store_n(&counters->live[tag], live, __ATOMIC_RELAXED);
+  
+  return;
+}
+
+/*
+  Find counters for this thread. The counters of a thread that exited
+  are taken over as they are so the totals stay right, otherwise new
+  ones are mapped and added to the list.
+*/
+struct tag_counters* thread_tag_counters(){
+
+  pthread_mutex_lock(&wmalloc_tags.lock);
+
+  if(wmalloc_tags.key_created == 0){
+    if(pthread_key_create(&wmalloc_tags.key, release_tag_counters) != 0){
+      pthread_mutex_unlock(&wmalloc_tags.lock);
+      return NULL;
+    }
+    wmalloc_tags.key_created = 1;
+
+    //tagged chunks are counted and freed by any thread
+    if(wmalloc_ptr != NULL){
+      wmalloc_ptr->threaded = 1;
+    }
+  }
+  
+  struct tag_counters* curr = wmalloc_tags.threads;
+  while(curr != NULL && curr->in_use == 1){
+    curr = curr->next;
+  }
+
+  if(curr == NULL){
+
+    curr = mmap(NULL, sizeof(struct tag_counters), PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(curr == (void*) -1){
+      pthread_mutex_unlock(&wmalloc_tags.lock);
+      return NULL;
+    }
+    curr->next = wmalloc_tags.threads;
+    __atomic_store_n(&wmalloc_tags.threads, curr, __ATOMIC_RELEASE);
+  }
+
+  curr->in_use = 1;
+  pthread_mutex_unlock(&wmalloc_tags.lock);
+
+  pthread_setspecific(wmalloc_tags.key, curr);
+  my_tag_counters = curr;
+  
+  return curr;
+}
+
+/*
+  Called when a thread with counters exits
+*/
+void release_tag_counters(void* counters){
+
+  pthread_mutex_lock(&wmalloc_tags.lock);
+  ((struct tag_counters*)counters)->in_use = 0;
+  pthread_mutex_unlock(&wmalloc_tags.lock);
+
+  my_tag_counters = NULL;
+  
+  return;
+}
+
+/*
+  Write a snapshot of the layout of the default heap to 'fd' for
+  wmheap to analyse, followed by one for each NUMA arena. See
+  heap_dump for the format.
+  Returns -1 if writing fails.
+*/
+int wmalloc_dump_heap(int fd){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+  if(heap_dump(wmalloc_ptr, fd) == -1){
+    return -1;
+  }
+
+  int count = __atomic_load_n(&wmalloc_arenas.count, __ATOMIC_ACQUIRE);
+  for(int i=0; i<count; i++){
+    if(heap_dump(wmalloc_arenas.heap[i], fd) == -1){
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+  Write a snapshot of the layout of 'heap' to 'fd'.
+
+  The dump is a stream of 64 bit words:
+
+    WMALLOC_DUMP_MAGIC, the address of the heap, the number of bins
+    and the upper bound of each bin
+
+  then for every region
+
+    DUMP_REGION with the kind of region in the low byte and its
+    colour in the next two, the start address and the length
+
+  followed by a word for each chunk in the region from the first to
+  the last, as the boundary tags link them. A chunk word holds the
+  size, IN_USE_FLAG, PURGED_FLAG for an available chunk whose pages
+  were released, and the tag of a chunk in use at TAG_SHIFT. Chunks
+  freed but not consolidated yet count as in use. The dump ends with
+  DUMP_END.
+
+  The heap is locked for the walk, which is collected in a buffer
+  mapped for it and written out once the lock is let go. A reader of
+  'fd' that allocates does not hold up the heap.
+*/
+int heap_dump(wmalloc_heap_t heap, int fd){
+
+  struct dump_buffer out;
+  out.fd = fd;
+  out.count = 0;
+  out.capacity = 0;
+  out.words = NULL;
+  out.failed = 0;
+
+  lock_wmalloc(heap);
+
+  dump_word(&out, WMALLOC_DUMP_MAGIC);
+  dump_word(&out, (uint64_t)heap);
+  dump_word(&out, heap->num_bins);
+  for(int i=0; i<heap->num_bins; i++){
+    dump_word(&out, heap->bin_index[i]);
+  }
+  
+  struct region* curr = heap->regions.next;
+  while(curr != &heap->regions){
+
+    dump_region(heap, &out, DUMP_REGION_MAPPED | (curr->colour << 8), region_start(curr), curr->size,
+                (struct chunk*)(curr + 1));
+    curr = curr->next;
+  }
+
+  //small regions sit one after the other without headers
+  for(uint64_t start = heap->small_base; start < heap->small_top; start = start + wmalloc_conf.region_size){
+
+    uint64_t colour = small_region_colour(heap, (void*)start);
+    dump_region(heap, &out, DUMP_REGION_SMALL | (colour << 8), (void*)start, wmalloc_conf.region_size,
+                (struct chunk*)(start + colour));
+  }
+
+  //and so do the regions carved out of a span, with headers
+  if(heap->span_capacity != 0){
+
+    uint64_t offset = SPAN_FIRST_REGION;
+    while(offset < heap->span_top){
+
+      struct region* span_region = (struct region*)((uint64_t)heap + offset);
+      dump_region(heap, &out, DUMP_REGION_SPAN, span_region, span_region->size,
+                  (struct chunk*)(span_region + 1));
+      offset = offset + span_region->size;
+    }
+  }
+  
+  unlock_wmalloc(heap);
+
+  dump_word(&out, DUMP_END);
+  flush_dump(&out);
+
+  if(out.failed == 1){
+    return -1;
+  }
+  return 1;
+}
+
+/*
+  Write the record of one region and a word for each of its chunks
+*/
+void dump_region(struct wmalloc_info* heap, struct dump_buffer* out, uint64_t kind,
+                 void* start, uint64_t length, struct chunk* first){
+
+  dump_word(out, DUMP_REGION | kind);
+  dump_word(out, (uint64_t)start);
+  dump_word(out, length);
+
+  uint64_t end = (uint64_t)start + length;
+  struct chunk* ch = first;
+  
+  while((uint64_t)ch < end){
+
+    uint64_t word = ch->curr_chunk_size;
+
+    if(is_chunk_in_use(heap, ch) == 1){
+      word = word | IN_USE_FLAG | (ch->prev_chunk_size & TAG_MASK);
+    }
+    else if(is_purged(ch) == 1){
+      word = word | PURGED_FLAG;
+    }
+    dump_word(out, word);
+
+    if(get_next_chunk_size(ch) == 0){
+      break;
+    }
+    ch = get_next_chunk(ch);
+  }
+  return;
+}
+
+/*
+  Returns 1 if chunk 'ch' is in use. A neighbor tells, otherwise the
+  chunk is the whole region and in use unless it sits in its bin or in
+  the reserve.
+  The caller holds the lock.
+*/
+int is_chunk_in_use(struct wmalloc_info* heap, struct chunk* ch){
+
+  if(get_next_chunk_size(ch) != 0){
+    return get_next_chunk(ch)->prev_chunk_size >> 63;
+  }
+  if(get_prev_chunk_size(ch) != 0){
+    uint64_t* ptr_to_size = (uint64_t*)((uint64_t)ch - 8);
+    return (*ptr_to_size) >> 63;
+  }
+
+  struct chunk* curr = get_right(heap, &heap->dummy[bin_of(heap, ch->curr_chunk_size)]);
+  while(curr != NULL){
+    if(curr == ch){
+      return 0;
+    }
+    curr = get_right(heap, curr);
+  }
+
+  curr = heap->reserve;
+  while(curr != NULL){
+    if(curr == ch){
+      return 0;
+    }
+    curr = get_right(heap, curr);
+  }
+  
+  return 1;
+}
+
+/*
+  Add a word to the dump, making the buffer bigger when it is full
+*/
+void dump_word(struct dump_buffer* out, uint64_t word){
+
+  if(out->count == out->capacity && grow_dump(out) == -1){
+    out->failed = 1;
+    return;
+  }
+  out->words[out->count] = word;
+  out->count++;
+
+  return;
+}
+
+/*
+  Map a buffer twice the size for the dump and move the words over.
+  The buffer is not taken from a heap, the one being walked is locked.
+  Returns -1 if it could not be mapped.
+*/
+int grow_dump(struct dump_buffer* out){
+
+  uint64_t capacity = out->capacity == 0 ? DUMP_BUFFER_WORDS : out->capacity*2;
+
+  uint64_t* words = mmap(NULL, capacity*sizeof(uint64_t), PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(words == (void*) -1){
+    return -1;
+  }
+  if(out->words != NULL){
+    memcpy(words, out->words, out->count*sizeof(uint64_t));
+    munmap(out->words, out->capacity*sizeof(uint64_t));
+  }
+  out->words = words;
+  out->capacity = capacity;
+  
+  return 1;
+}
+
+/*
+  Write the dump out and unmap its buffer
+*/
+void flush_dump(struct dump_buffer* out){
+
+  char* data = (char*)out->words;
+  uint64_t left = out->count*sizeof(uint64_t);
+
+  while(left > 0 && out->failed == 0){
+
+    ssize_t written = write(out->fd, data, left);
+    if(written == -1 && errno == EINTR){
+      continue;
+    }
+    if(written <= 0){
+      out->failed = 1;
+      break;
+    }
+    data = data + written;
+    left = left - written;
+  }
+  if(out->words != NULL){
+    munmap(out->words, out->capacity*sizeof(uint64_t));
+  }
+  out->words = NULL;
+  out->capacity = 0;
+  out->count = 0;
+  
+  return;
+}
+
+/*
+  Give each NUMA node arenas of its own. wmalloc then serves a thread
+  from an arena on the node it runs on, whose memory is bound to that
+  node with mbind, and wfree hands a chunk back to the arena it came
+  from.
+
+  With a 'count' of 0 there is one arena per node. More arenas than
+  nodes are spread over the nodes and a thread picks among those of
+  its node by CPU, so the arenas can be tried on a single node
+  machine. Chunks allocated before the call stay with the default
+  heap.
+
+  Call it before the threads that allocate are started, or set the
+  count with arenas in WMALLOC_CONF. Not available with
+  WMALLOC_COMPACT, where all of wmalloc lies in one cage.
+  Returns the number of arenas, or -1 if none could be created.
+*/
+int wmalloc_numa_arenas(int count){
+
+#ifdef WMALLOC_COMPACT
+  printf("wmalloc: no arenas with WMALLOC_COMPACT\n");
+  return -1;
+#endif
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&wmalloc_arenas.lock);
+
+  if(wmalloc_arenas.count != 0){
+    pthread_mutex_unlock(&wmalloc_arenas.lock);
+    return wmalloc_arenas.count;
+  }
+
+  int nodes = numa_node_count();
+  if(count <= 0){
+    count = nodes;
+  }
+  if(count > MAX_ARENAS){
+    count = MAX_ARENAS;
+  }
+
+  for(int i=0; i<count; i++){
+
+    struct wmalloc_info* heap = heap_create();
+    if(heap == NULL){
+      printf("wmalloc: could not create arena %d\n", i);
+      pthread_mutex_unlock(&wmalloc_arenas.lock);
+      return -1;
+    }
+    heap->arena = i+1;
+    heap->numa_node = i % nodes;
+    wmalloc_arenas.heap[i] = heap;
+  }
+  wmalloc_arenas.nodes = nodes;
+
+  //wmalloc and wfree look at the count first
+  __atomic_store_n(&wmalloc_arenas.count, count, __ATOMIC_RELEASE);
+  
+  pthread_mutex_unlock(&wmalloc_arenas.lock);
+  
+  return count;
+}
+
+/*
+  Allocate a buffer whose pages are spread over all nodes, for large
+  buffers every node reads. Pages that are already there are moved.
+  The buffer is freed with wfree.
+*/
+void* wmalloc_interleaved(uint64_t request_length){
+
+  char* buffer = wmalloc(request_length);
+  if(buffer == NULL){
+    return NULL;
+  }
+
+  //only the pages that belong to the buffer alone
+  uint64_t start = ((uint64_t)buffer + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+  uint64_t end = ((uint64_t)buffer + request_length) & ~((uint64_t)PAGE_SIZE - 1);
+
+  if(end > start){
+
+    int nodes = numa_node_count();
+    uint64_t all_nodes = (nodes == 64) ? 0xffffffffffffffff : ((uint64_t)1 << nodes) - 1;
+
+    set_numa_policy((void*)start, end - start, WMALLOC_MPOL_INTERLEAVE, all_nodes, WMALLOC_MPOL_MF_MOVE);
+  }
+  
+  return buffer;
+}
+
+/*
+  Returns the arena for the node this thread runs on. The node is
+  looked up again every ARENA_RECHECK calls, threads seldom move.
+*/
+struct wmalloc_info* thread_arena(){
+
+  my_arena_uses--;
+  
+  if(my_arena != NULL && my_arena_uses > 0){
+    return my_arena;
+  }
+  
+  unsigned int cpu = 0;
+  unsigned int node = 0;
+  if(syscall(SYS_getcpu, &cpu, &node, NULL) == -1){
+    cpu = 0;
+    node = 0;
+  }
+
+  int count = wmalloc_arenas.count;
+  int nodes = wmalloc_arenas.nodes;
+
+  //arena i is on node i % nodes
+  int on_node = (count - (int)node + nodes - 1)/nodes;
+  int index;
+  if(on_node > 0){
+    index = node + nodes*(cpu % on_node);
+  }
+  else{
+    index = node % count;
+  }
+
+  my_arena = wmalloc_arenas.heap[index];
+  my_arena_uses = ARENA_RECHECK;
+  
+  return my_arena;
+}
+
+/*
+  Returns the heap that 'ptr' was allocated from by wmalloc: the
+  arena that owns its granule, or the default heap
+*/
+struct wmalloc_info* heap_of(void* ptr){
+
+  uint64_t granule = (uint64_t)ptr >> ARENA_GRANULE_SHIFT;
+  
+  uint8_t* leaf = __atomic_load_n(&wmalloc_arenas.map[granule >> ARENA_LEAF_BITS], __ATOMIC_ACQUIRE);
+  if(leaf == NULL){
+    return wmalloc_ptr;
+  }
+
+  int arena = __atomic_load_n(&leaf[granule & ((1 << ARENA_LEAF_BITS) - 1)], __ATOMIC_RELAXED);
+  if(arena == 0){
+    return wmalloc_ptr;
+  }
+  return wmalloc_arenas.heap[arena-1];
+}
+
+/*
+  Record that the granules from 'start' for 'length' bytes belong to
+  'arena', or to none with 0. The leaves of the map are mapped the
+  first time they are needed.
+*/
+void set_arena_range(void* start, uint64_t length, int arena){
+
+  uint64_t first = (uint64_t)start >> ARENA_GRANULE_SHIFT;
+  uint64_t last = ((uint64_t)start + length - 1) >> ARENA_GRANULE_SHIFT;
+
+  for(uint64_t granule = first; granule <= last; granule++){
+
+    uint8_t** slot = &wmalloc_arenas.map[granule >> ARENA_LEAF_BITS];
+    uint8_t* leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    
+    if(leaf == NULL){
+
+      leaf = mmap(NULL, 1 << ARENA_LEAF_BITS, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if(leaf == (void*) -1){
+        return;
+      }
+
+      //another arena may have put one in first
+      uint8_t* expected = NULL;
+      if(!__atomic_compare_exchange_n(slot, &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        munmap(leaf, 1 << ARENA_LEAF_BITS);
+        leaf = expected;
+      }
+    }
+
+    __atomic_store_n(&leaf[granule & ((1 << ARENA_LEAF_BITS) - 1)], arena, __ATOMIC_RELAXED);
+  }
+  return;
+}
+
+/*
+  Map 'length' bytes starting on an ARENA_GRANULE boundary, so that no
+  other heap shares a granule with them
+*/
+void* map_aligned(uint64_t length, int prot, int flags){
+
+  char* mmap_ptr = mmap(NULL, length + ARENA_GRANULE, prot, flags, -1, 0);
+  if(mmap_ptr == (void*) -1){
+    return mmap_ptr;
+  }
+
+  uint64_t start = ((uint64_t)mmap_ptr + ARENA_GRANULE - 1) & ~((uint64_t)ARENA_GRANULE - 1);
+  uint64_t head = start - (uint64_t)mmap_ptr;
+
+  if(head > 0){
+    munmap(mmap_ptr, head);
+  }
+  munmap((void*)(start + length), ARENA_GRANULE - head);
+  
+  return (void*)start;
+}
+
+/*
+  Set the NUMA memory policy of a range. Fails quietly on kernels
+  without NUMA support, where there is only the one node anyway.
+*/
+void set_numa_policy(void* start, uint64_t length, int mode, uint64_t nodemask, int flags){
+
+  unsigned long mask = nodemask;
+  
+  syscall(SYS_mbind, start, length, mode, &mask, sizeof(mask)*8 + 1, flags);
+  return;
+}
+
+/*
+  Returns the number of NUMA nodes, 1 if it cannot be told
+*/
+int numa_node_count(){
+
+  int nodes = 1;
+  
+  FILE* file = fopen("/sys/devices/system/node/possible", "r");
+  if(file == NULL){
+    return nodes;
+  }
+
+  //a list like 0 or 0-1, the last number is the highest node
+  char line[64];
+  if(fgets(line, sizeof(line), file) != NULL){
+
+    char* last = line;
+    for(char* c = line; *c != '\0'; c++){
+      if(*c == '-' || *c == ','){
+        last = c+1;
+      }
+    }
+    nodes = atoi(last) + 1;
+  }
+  fclose(file);
+
+  if(nodes < 1){
+    nodes = 1;
+  }
+  if(nodes > 64){
+    nodes = 64;
+  }
+  return nodes;
+}
+
+/*
+  Free 'count' chunks from wmalloc at once. The lock of a heap is
+  taken once for up to DEFERRED_BATCH chunks in a row that belong to
+  it rather than once per chunk.
+*/
+void wfree_bulk(void** ptrs, uint64_t count){
+
+  uint64_t i = 0;
+  
+  while(i < count){
+
+    struct wmalloc_info* heap = wmalloc_ptr;
+    if(wmalloc_arenas.count != 0){
+      heap = heap_of(ptrs[i]);
+    }
+
+    //the accounting is done before the lock is taken
+    uint64_t end = i;
+    while(end < count && end - i < DEFERRED_BATCH){
+
+      if(wmalloc_arenas.count != 0 && heap_of(ptrs[end]) != heap){
+        break;
+      }
+      note_free(heap, ptrs[end]);
+      end++;
+    }
+
+    lock_wmalloc(heap);
+    for(uint64_t j=i; j<end; j++){
+      count_free(heap, (struct chunk*)((uint64_t)ptrs[j] - 16));
+      free_chunk(heap, (struct chunk*)((uint64_t)ptrs[j] - 16));
+    }
+    unlock_wmalloc(heap);
+
+    i = end;
+  }
+  return;
+}
+
+/*
+  Enter a critical section of this thread. Until wmalloc_epoch_exit
+  nothing retired with wmalloc_retire, by any thread, is freed, so
+  objects read from a lock free structure stay valid. Sections do not
+  nest.
+*/
+void wmalloc_epoch_enter(){
+
+  struct epoch_thread* thread = my_epoch;
+  if(thread == NULL){
+    thread = thread_epoch();
+    if(thread == NULL){
+      return;
+    }
+  }
+
+  uint64_t epoch = __atomic_load_n(&wmalloc_epochs.global, __ATOMIC_ACQUIRE);
+
+  //announced before anything shared is read
+  __atomic_store_n(&thread->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  
+  return;
+}
+
+/*
+  Leave the critical section of this thread
+*/
+void wmalloc_epoch_exit(){
+
+  struct epoch_thread* thread = my_epoch;
+  if(thread != NULL){
+    __atomic_store_n(&thread->state, thread->state & ~((uint64_t)1), __ATOMIC_RELEASE);
+  }
+  return;
+}
+
+/*
+  Free 'ptr' from wmalloc once no thread can still be reading it: it
+  was unlinked from the shared structure and every thread in a
+  critical section now has left it since.
+
+  The pointer is put in a bag of this thread for the current epoch.
+  Every RETIRE_BATCH retires the thread tries to move the epoch on,
+  which works once all threads in a critical section are in the
+  current one. The bag of an epoch two behind the current one is
+  freed in bulk.
+*/
+void wmalloc_retire(void* ptr){
+
+  struct epoch_thread* thread = my_epoch;
+  if(thread == NULL){
+    thread = thread_epoch();
+    if(thread == NULL){
+      return;
+    }
+  }
+  
+  uint64_t epoch = __atomic_load_n(&wmalloc_epochs.global, __ATOMIC_ACQUIRE);
+
+  collect_retired(thread, epoch);
+  
+  int bag = epoch % 3;
+  thread->bag_epoch[bag] = epoch;
+
+  if(thread->bag_count[bag] == thread->bag_size[bag]){
+    if(grow_bag(thread, bag) == -1){
+      printf("wmalloc: no memory for retired objects\n");
+      return;
+    }
+  }
+  thread->bag[bag][thread->bag_count[bag]] = ptr;
+  thread->bag_count[bag]++;
+  
+  thread->retired++;
+  if(thread->retired % RETIRE_BATCH == 0){
+    try_advance_epoch(epoch);
+  }
+  return;
+}
+
+/*
+  Free what can be freed of the objects this thread and exited
+  threads retired, moving the epoch on where the other threads allow.
+  Call it outside a critical section.
+  Returns the number of retired objects still waiting.
+*/
+uint64_t wmalloc_retire_flush(){
+
+  struct epoch_thread* thread = my_epoch;
+  uint64_t waiting = 0;
+
+  //two epochs on everything retired so far is safe
+  for(int n=0; n<2; n++){
+    try_advance_epoch(__atomic_load_n(&wmalloc_epochs.global, __ATOMIC_ACQUIRE));
+  }
+  uint64_t epoch = __atomic_load_n(&wmalloc_epochs.global, __ATOMIC_ACQUIRE);
+
+  if(thread != NULL){
+    collect_retired(thread, epoch);
+  }
+
+  pthread_mutex_lock(&wmalloc_epochs.lock);
+  struct epoch_thread* curr = wmalloc_epochs.threads;
+  while(curr != NULL){
+
+    if(curr->in_use == 0){
+      collect_retired(curr, epoch);
+    }
+    if(curr->in_use == 0 || curr == thread){
+      waiting = waiting + curr->bag_count[0] + curr->bag_count[1] + curr->bag_count[2];
+    }
+    curr = curr->next;
+  }
+  pthread_mutex_unlock(&wmalloc_epochs.lock);
+
+  return waiting;
+}
+
+/*
+  Free the bags of 'thread' that are two epochs or more behind 'epoch'
+*/
+void collect_retired(struct epoch_thread* thread, uint64_t epoch){
+
+  for(int bag=0; bag<3; bag++){
+
+    if(thread->bag_count[bag] > 0 && thread->bag_epoch[bag] + 2 <= epoch){
+
+      wfree_bulk(thread->bag[bag], thread->bag_count[bag]);
+      thread->bag_count[bag] = 0;
+    }
+  }
+  return;
+}
+
+/*
+  Move the global epoch from 'epoch' to the next one if every thread
+  in a critical section entered it in 'epoch'
+*/
+void try_advance_epoch(uint64_t epoch){
+
+  struct epoch_thread* curr = __atomic_load_n(&wmalloc_epochs.threads, __ATOMIC_ACQUIRE);
+  while(curr != NULL){
+
+    uint64_t state = __atomic_load_n(&curr->state, __ATOMIC_SEQ_CST);
+    if((state & 1) == 1 && (state >> 1) != epoch){
+      return;
+    }
+    curr = curr->next;
+  }
+
+  __atomic_compare_exchange_n(&wmalloc_epochs.global, &epoch, epoch+1, 0,
+                              __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  return;
+}
+
+/*
+  Double the room in a bag. The bags are mapped rather than taken
+  from wmalloc.
+*/
+int grow_bag(struct epoch_thread* thread, int bag){
+
+  uint64_t size = thread->bag_size[bag]*2;
+  if(size == 0){
+    size = RETIRE_BATCH*8;
+  }
+
+  void** grown = mmap(NULL, size*sizeof(void*), PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(grown == (void*) -1){
+    return -1;
+  }
+
+  if(thread->bag[bag] != NULL){
+    memcpy(grown, thread->bag[bag], thread->bag_count[bag]*sizeof(void*));
+    munmap(thread->bag[bag], thread->bag_size[bag]*sizeof(void*));
+  }
+  thread->bag[bag] = grown;
+  thread->bag_size[bag] = size;
   
-  i++;
-  while(i < NUM_BINS){
-    if(wmalloc_ptr->bin[i]->right_ptr != NULL){
-      to_remove = remove_chunk(wmalloc_ptr->bin[i]->right_ptr);
+  return 1;
+}
+
+/*
+  Find an epoch record for this thread. One left by a thread that
+  exited is taken over with whatever it still had retired, like the
+  tag counters.
+*/
+struct epoch_thread* thread_epoch(){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return NULL;
+    }
+  }
+  
+  pthread_mutex_lock(&wmalloc_epochs.lock);
+
+  if(wmalloc_epochs.key_created == 0){
+    if(pthread_key_create(&wmalloc_epochs.key, release_epoch_thread) != 0){
+      pthread_mutex_unlock(&wmalloc_epochs.lock);
+      return NULL;
+    }
+    wmalloc_epochs.key_created = 1;
+
+    //retired objects are freed by whichever thread gets to them
+    wmalloc_ptr->threaded = 1;
+  }
+  
+  struct epoch_thread* curr = wmalloc_epochs.threads;
+  while(curr != NULL && curr->in_use == 1){
+    curr = curr->next;
+  }
+
+  if(curr == NULL){
+
+    curr = mmap(NULL, sizeof(struct epoch_thread), PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(curr == (void*) -1){
+      pthread_mutex_unlock(&wmalloc_epochs.lock);
+      return NULL;
+    }
+    curr->next = wmalloc_epochs.threads;
+    __atomic_store_n(&wmalloc_epochs.threads, curr, __ATOMIC_RELEASE);
+  }
+
+  curr->in_use = 1;
+  pthread_mutex_unlock(&wmalloc_epochs.lock);
+
+  pthread_setspecific(wmalloc_epochs.key, curr);
+  my_epoch = curr;
+  
+  return curr;
+}
+
+/*
+  Called when a thread with an epoch record exits. What it retired
+  is freed by wmalloc_retire_flush or the next thread to take the
+  record.
+*/
+void release_epoch_thread(void* record){
+
+  struct epoch_thread* thread = (struct epoch_thread*) record;
+  
+  pthread_mutex_lock(&wmalloc_epochs.lock);
+  __atomic_store_n(&thread->state, 0, __ATOMIC_RELEASE);
+  thread->in_use = 0;
+  pthread_mutex_unlock(&wmalloc_epochs.lock);
+
+  my_epoch = NULL;
+  
+  return;
+}
+
+/*
+  Returns a mark of the scratch space of this thread. Everything
+  allocated with wmalloc_scratch_alloc after it is given back at once
+  by wmalloc_scratch_release with the mark.
+*/
+void* wmalloc_scratch_mark(){
+
+  return my_scratch.top;
+}
+
+/*
+  Allocate 'length' bytes, aligned to 16, of scratch space. It is a
+  bump of a pointer while the current block has room. The space is
+  only for this thread and cannot be freed on its own, only released
+  back to a mark.
+  Returns NULL if no block can be had from wmalloc.
+*/
+void* wmalloc_scratch_alloc(uint64_t length){
+
+  char* ptr = (char*)(((uint64_t)my_scratch.top + 15) & ~((uint64_t)15));
+
+  if(my_scratch.top != NULL && ptr + length <= my_scratch.end){
+    my_scratch.top = ptr + length;
+    return ptr;
+  }
+
+  struct scratch_block* block = scratch_block_for(length);
+  if(block == NULL){
+    return NULL;
+  }
+  
+  block->prev = my_scratch.current;
+  my_scratch.current = block;
+  my_scratch.end = (char*)(block + 1) + block->size;
+  
+  ptr = (char*)(((uint64_t)(block + 1) + 15) & ~((uint64_t)15));
+  my_scratch.top = ptr + length;
+  
+  return ptr;
+}
+
+/*
+  Give back the scratch space allocated since 'mark'. Blocks that are
+  no longer needed are kept for the next allocations, up to
+  SCRATCH_SPARE of them, and the rest go back to wfree.
+*/
+void wmalloc_scratch_release(void* mark){
+
+  char* target = (char*) mark;
+  
+  while(my_scratch.current != NULL){
+
+    struct scratch_block* block = my_scratch.current;
+    char* data = (char*)(block + 1);
+    
+    if(target >= data && target <= data + block->size){
       break;
     }
-    i++;
+
+    my_scratch.current = block->prev;
+
+    if(my_scratch.spare_count < SCRATCH_SPARE){
+      block->prev = my_scratch.spare;
+      my_scratch.spare = block;
+      my_scratch.spare_count++;
+    }
+    else{
+      wfree(block);
+    }
+  }
+
+  if(my_scratch.current == NULL){
+    my_scratch.top = NULL;
+    my_scratch.end = NULL;
+    return;
+  }
+  
+  my_scratch.top = target;
+  my_scratch.end = (char*)(my_scratch.current + 1) + my_scratch.current->size;
+  
+  return;
+}
+
+/*
+  Returns a block with room for 'length' bytes aligned to 16, a spare
+  one if there is one big enough. New blocks are SCRATCH_BLOCK_SIZE
+  unless the request needs more.
+*/
+struct scratch_block* scratch_block_for(uint64_t length){
+
+  uint64_t needed = length + 16;
+
+  struct scratch_block** link = &my_scratch.spare;
+  while(*link != NULL){
+
+    struct scratch_block* block = *link;
+    if(block->size >= needed){
+      *link = block->prev;
+      my_scratch.spare_count--;
+      return block;
+    }
+    link = &block->prev;
+  }
+
+  if(scratch.key_created == 0){
+
+    pthread_mutex_lock(&scratch.lock);
+    if(scratch.key_created == 0 && pthread_key_create(&scratch.key, release_scratch) == 0){
+      scratch.key_created = 1;
+    }
+    pthread_mutex_unlock(&scratch.lock);
+  }
+  if(my_scratch.current == NULL && my_scratch.spare == NULL && scratch.key_created == 1){
+    pthread_setspecific(scratch.key, &my_scratch);
+  }
+  
+  uint64_t size = SCRATCH_BLOCK_SIZE;
+  if(needed > size){
+    size = needed;
+  }
+
+  struct scratch_block* block = wmalloc(sizeof(struct scratch_block) + size);
+  if(block == NULL){
+    return NULL;
+  }
+  block->size = size;
+  
+  return block;
+}
+
+/*
+  Called when a thread with scratch blocks exits
+*/
+void release_scratch(void* state){
+
+  (void)state;
+  wmalloc_scratch_release(NULL);
+
+  while(my_scratch.spare != NULL){
+    struct scratch_block* block = my_scratch.spare;
+    my_scratch.spare = block->prev;
+    wfree(block);
+  }
+  my_scratch.spare_count = 0;
+  
+  return;
+}
+ 
+/*
+  Have the background thread watch how short of memory the program is
+  and hold on to less free memory the shorter it gets.
+
+  The pressure comes from two places. The usage of the cgroup against
+  its limit (memory.current and memory.max, or memory.usage_in_bytes
+  and memory.limit_in_bytes on cgroup v1) counts from
+  WMALLOC_PRESSURE_USAGE_LOW percent of the limit up to full pressure
+  at WMALLOC_PRESSURE_USAGE_HIGH. The share of time tasks stalled on
+  memory over the last 10 seconds (PSI, memory.pressure of the cgroup
+  or /proc/pressure/memory) counts up to full pressure at
+  WMALLOC_PRESSURE_STALL_HIGH percent.
+
+  On each pass the decay is cut by the pressure, so free pages are
+  purged and empty regions unmapped sooner. At full pressure all of
+  them are released at once, the regions in the reserve are unmapped
+  and the reserve is not refilled until the pressure drops.
+
+  'cgroup_dir' is the directory of the cgroup to read, NULL for the
+  cgroup of the program. Starts the background thread with an
+  interval of WMALLOC_PRESSURE_INTERVAL ms if it is not running.
+  Returns -1 if neither the cgroup nor PSI can be read.
+*/
+int wmalloc_pressure_watch(const char* cgroup_dir){
+
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return -1;
+    }
+  }
+
+  struct wmalloc_pressure found;
+  memset(&found, 0, sizeof(struct wmalloc_pressure));
+
+  if(cgroup_dir != NULL){
+    find_pressure_files(&found, cgroup_dir);
+  }
+  else{
+    find_own_cgroup(&found);
+  }
+
+  if(found.psi_path[0] == '\0' && access("/proc/pressure/memory", R_OK) == 0){
+    strcpy(found.psi_path, "/proc/pressure/memory");
+  }
+
+  if(found.max_path[0] == '\0' && found.psi_path[0] == '\0'){
+    printf("wmalloc: no cgroup limit or memory pressure to watch\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&wmalloc_bg.lock);
+  int maintain = wmalloc_bg.maintain;
+  strcpy(wmalloc_pressure.current_path, found.current_path);
+  strcpy(wmalloc_pressure.max_path, found.max_path);
+  strcpy(wmalloc_pressure.psi_path, found.psi_path);
+  wmalloc_pressure.watch = 1;
+  pthread_mutex_unlock(&wmalloc_bg.lock);
+
+  if(maintain == 0){
+    return wmalloc_background_start(WMALLOC_PRESSURE_INTERVAL, wmalloc_conf.decay_ms);
+  }
+  return 1;
+}
+
+/*
+  Returns the memory pressure from 0 (none) to 100 (full) as of the
+  last pass of the background thread, see wmalloc_pressure_watch.
+*/
+int wmalloc_memory_pressure(){
+
+  return __atomic_load_n(&wmalloc_pressure.level, __ATOMIC_RELAXED);
+}
+
+/*
+  Fill in the files of 'pressure' that exist in 'dir', preferring the
+  cgroup v2 names.
+*/
+void find_pressure_files(struct wmalloc_pressure* pressure, const char* dir){
+
+  const char* current_names[] = {"memory.current", "memory.usage_in_bytes"};
+  const char* max_names[] = {"memory.max", "memory.limit_in_bytes"};
+  
+  for(int i=0; i<2 && pressure->max_path[0] == '\0'; i++){
+
+    snprintf(pressure->max_path, PRESSURE_PATH_LENGTH, "%s/%s", dir, max_names[i]);
+    snprintf(pressure->current_path, PRESSURE_PATH_LENGTH, "%s/%s", dir, current_names[i]);
+
+    if(access(pressure->max_path, R_OK) != 0 || access(pressure->current_path, R_OK) != 0){
+      pressure->max_path[0] = '\0';
+      pressure->current_path[0] = '\0';
+    }
+  }
+
+  snprintf(pressure->psi_path, PRESSURE_PATH_LENGTH, "%s/memory.pressure", dir);
+  if(access(pressure->psi_path, R_OK) != 0){
+    pressure->psi_path[0] = '\0';
+  }
+  return;
+}
+
+/*
+  Find the memory cgroup of the program from /proc/self/cgroup, either
+  the unified (v2) one or the v1 memory controller. Inside a cgroup
+  namespace the cgroup is mounted as the root of the hierarchy.
+*/
+void find_own_cgroup(struct wmalloc_pressure* pressure){
+
+  FILE* file = fopen("/proc/self/cgroup", "r");
+  if(file == NULL){
+    return;
+  }
+
+  //lines like 0::/path for v2 and 4:memory:/path for v1, short
+  //enough for the path to fit after the hierarchy
+  char line[PRESSURE_PATH_LENGTH - 32];
+  char dir[PRESSURE_PATH_LENGTH];
+  
+  while(pressure->max_path[0] == '\0' && fgets(line, sizeof(line), file) != NULL){
+
+    line[strcspn(line, "\n")] = '\0';
+    
+    const char* hierarchy;
+    char* path;
+    if(strncmp(line, "0::", 3) == 0){
+      hierarchy = "/sys/fs/cgroup";
+      path = line + 3;
+    }
+    else if(strstr(line, ":memory:") != NULL){
+      hierarchy = "/sys/fs/cgroup/memory";
+      path = strstr(line, ":memory:") + 8;
+    }
+    else{
+      continue;
+    }
+
+    snprintf(dir, sizeof(dir), "%s%s", hierarchy, path);
+    find_pressure_files(pressure, dir);
+
+    if(pressure->max_path[0] == '\0'){
+      find_pressure_files(pressure, hierarchy);
+    }
+  }
+  fclose(file);
+  
+  return;
+}
+
+/*
+  Work out the memory pressure from 0 to 100 from the files found by
+  wmalloc_pressure_watch
+*/
+int read_pressure_level(){
+
+  int level = 0;
+  uint64_t current;
+  uint64_t max;
+
+  if(read_number_file(wmalloc_pressure.current_path, &current) != -1 &&
+     read_number_file(wmalloc_pressure.max_path, &max) != -1 && max != 0){
+
+    //a limit of max or close to the largest number means no limit
+    uint64_t used = (max >= ((uint64_t)1 << 62)) ? 0 : current/(max/100 + 1);
+    
+    if(used > WMALLOC_PRESSURE_USAGE_LOW){
+      level = (used - WMALLOC_PRESSURE_USAGE_LOW)*100/
+        (WMALLOC_PRESSURE_USAGE_HIGH - WMALLOC_PRESSURE_USAGE_LOW);
+    }
+  }
+
+  FILE* file = wmalloc_pressure.psi_path[0] != '\0' ? fopen(wmalloc_pressure.psi_path, "r") : NULL;
+  if(file != NULL){
+
+    //some avg10=1.23 avg60=0.50 avg300=0.10 total=12345
+    double stalled;
+    if(fscanf(file, "some avg10=%lf", &stalled) == 1){
+
+      int stall_level = stalled*100/WMALLOC_PRESSURE_STALL_HIGH;
+      if(stall_level > level){
+        level = stall_level;
+      }
+    }
+    fclose(file);
+  }
+
+  if(level > 100){
+    level = 100;
+  }
+  return level;
+}
+
+/*
+  Read the number in a cgroup file. The word max reads as the largest
+  number. Returns -1 if the file cannot be read.
+*/
+int read_number_file(const char* path, uint64_t* value){
+
+  if(path[0] == '\0'){
+    return -1;
+  }
+  
+  FILE* file = fopen(path, "r");
+  if(file == NULL){
+    return -1;
+  }
+
+  char line[64];
+  int result = -1;
+  if(fgets(line, sizeof(line), file) != NULL){
+
+    if(strncmp(line, "max", 3) == 0){
+      *value = 0xffffffffffffffff;
+      result = 1;
+    }
+    else if(line[0] >= '0' && line[0] <= '9'){
+      *value = strtoull(line, NULL, 10);
+      result = 1;
+    }
+  }
+  fclose(file);
+  
+  return result;
+}
+
+/*
+  Unmap the regions waiting in the reserve of the default heap.
+  Returns the number of bytes released.
+*/
+uint64_t release_reserve(){
+
+  lock_wmalloc(wmalloc_ptr);
+  struct chunk* ch = wmalloc_ptr->reserve;
+  wmalloc_ptr->reserve = NULL;
+  wmalloc_ptr->reserve_count = 0;
+  for(struct chunk* curr = ch; curr != NULL; curr = get_right(wmalloc_ptr, curr)){
+    unlink_region(curr);
+  }
+  unlock_wmalloc(wmalloc_ptr);
+
+  uint64_t released = 0;
+  while(ch != NULL){
+
+    struct chunk* next = get_right(wmalloc_ptr, ch);
+    void* start = region_start(region_of(ch));
+    uint64_t region_size = region_of(ch)->size;
+    
+    WMALLOC_HOOK(region_unmap, wmalloc_ptr, start, region_size);
+    munmap(start, region_size);
+    __atomic_sub_fetch(&wmalloc_ptr->stats.mapped_bytes, region_size, __ATOMIC_RELAXED);
+    
+    released = released + region_size;
+    ch = next;
+  }
+  return released;
+}
+
+/*
+  Tells whether moving the chunk at 'ptr' would help to empty its
+  region, for programs that defragment by copying their objects to a
+  new chunk and freeing the old one.
+
+  Returns 1 when the region of the chunk has less than
+  WMALLOC_DEFRAG_SPARSE percent of its bytes in use and a new chunk
+  of the same size would come out of an available chunk in another
+  region that is used more densely. Returns 0 otherwise, including
+  when the new chunk would need a new region.
+
+  Once the objects in a region have been moved it is one available
+  chunk again, which wmalloc_trim or the background thread unmaps.
+
+  The region is found in an index of the regions of the heap, and
+  the bytes in use in a region are added up the first time the scan
+  asks about it and kept for the rest of the scan, see
+  wmalloc_defrag_scan.
+*/
+int wmalloc_defrag_hint(void* ptr){
+
+  if(ptr == NULL || wmalloc_ptr == NULL){
+    return 0;
+  }
+  if(wmalloc_arenas.count != 0){
+    return heap_defrag_hint(heap_of(ptr), ptr);
+  }
+  return heap_defrag_hint(wmalloc_ptr, ptr);
+}
+
+/*
+  wmalloc_defrag_hint for a chunk from the given heap
+*/
+int heap_defrag_hint(wmalloc_heap_t heap, void* ptr){
+
+  struct chunk* ch = (struct chunk*)((uint64_t)ptr - 16);
+  int hint = 0;
+  
+  lock_wmalloc(heap);
+  pthread_mutex_lock(&wmalloc_defrag.lock);
+
+  //a region mapped or unmapped since the index was built
+  if(wmalloc_defrag.heap != heap
+     || wmalloc_defrag.mmap_calls != __atomic_load_n(&heap->stats.mmap_calls, __ATOMIC_RELAXED)
+     || wmalloc_defrag.mapped_bytes != __atomic_load_n(&heap->stats.mapped_bytes, __ATOMIC_RELAXED)){
+
+    if(index_regions(heap) == -1){
+      pthread_mutex_unlock(&wmalloc_defrag.lock);
+      unlock_wmalloc(heap);
+      return 0;
+    }
+  }
+
+  struct defrag_region* from = defrag_region_of(heap, ch);
+  if(from != NULL){
+
+    uint64_t percent = from->used*100/(from->end - (uint64_t)from->first);
+    if(percent < WMALLOC_DEFRAG_SPARSE){
+
+      struct chunk* target = peek_chunk(heap, ch->curr_chunk_size);
+      struct defrag_region* to = (target == NULL) ? NULL : defrag_region_of(heap, target);
+
+      if(to != NULL && to != from && to->used*100/(to->end - (uint64_t)to->first) > percent){
+        hint = 1;
+      }
+    }
+  }
+  
+  pthread_mutex_unlock(&wmalloc_defrag.lock);
+  unlock_wmalloc(heap);
+  
+  return hint;
+}
+
+/*
+  Start a new defragmentation scan. The bytes in use in each region
+  are added up again the next time wmalloc_defrag_hint asks about it.
+  Mapping or unmapping a region starts a new scan as well.
+*/
+void wmalloc_defrag_scan(){
+
+  pthread_mutex_lock(&wmalloc_defrag.lock);
+  wmalloc_defrag.heap = NULL;
+  pthread_mutex_unlock(&wmalloc_defrag.lock);
+
+  return;
+}
+
+/*
+  Forget the index of 'heap' before it goes, so that a heap created
+  at the same address does not find it
+*/
+void drop_region_index(struct wmalloc_info* heap){
+
+  pthread_mutex_lock(&wmalloc_defrag.lock);
+  if(wmalloc_defrag.heap == heap){
+    wmalloc_defrag.heap = NULL;
+  }
+  pthread_mutex_unlock(&wmalloc_defrag.lock);
+
+  return;
+}
+
+/*
+  Build the index of the regions of 'heap' sorted by address, none of
+  them measured yet. Returns -1 if the index could not be mapped.
+  The caller holds the lock of the heap and wmalloc_defrag.lock.
+*/
+int index_regions(struct wmalloc_info* heap){
+
+  wmalloc_defrag.heap = NULL;
+  wmalloc_defrag.count = 0;
+
+  if(heap->span_capacity != 0){
+
+    for(uint64_t offset = SPAN_FIRST_REGION; offset < heap->span_top;
+        offset = offset + ((struct region*)((uint64_t)heap + offset))->size){
+
+      struct region* curr = (struct region*)((uint64_t)heap + offset);
+      if(add_defrag_region((struct chunk*)(curr + 1), (uint64_t)curr + curr->size) == -1){
+        return -1;
+      }
+    }
+  }
+  else{
+
+    for(struct region* curr = heap->regions.next; curr != &heap->regions; curr = curr->next){
+      if(add_defrag_region((struct chunk*)(curr + 1), (uint64_t)region_start(curr) + curr->size) == -1){
+        return -1;
+      }
+    }
+  }
+
+  for(uint64_t start = heap->small_base; start < heap->small_top; start = start + wmalloc_conf.region_size){
+
+    struct chunk* first = (struct chunk*)(start + small_region_colour(heap, (void*)start));
+    if(add_defrag_region(first, start + wmalloc_conf.region_size) == -1){
+      return -1;
+    }
   }
+
+  qsort(wmalloc_defrag.regions, wmalloc_defrag.count, sizeof(struct defrag_region), compare_defrag_regions);
+
+  wmalloc_defrag.heap = heap;
+  wmalloc_defrag.mmap_calls = __atomic_load_n(&heap->stats.mmap_calls, __ATOMIC_RELAXED);
+  wmalloc_defrag.mapped_bytes = __atomic_load_n(&heap->stats.mapped_bytes, __ATOMIC_RELAXED);
   
-  return to_remove;
+  return 1;
 }
 
- 
 /*
-  The meat of the wmalloc program:
-  Returns a void pointer to a chunk of at least the requested size +
-  overhead.
-  The wmalloc data structure is initialized if first call to wmalloc.
+  Add the region from chunk 'first' to 'end' to the index, growing it
+  when it is full. Returns -1 if it could not grow.
+*/
+int add_defrag_region(struct chunk* first, uint64_t end){
 
-  Process for getting memory:
-  1. Look in proper bin
-  2. Look in bins of greater size
-  3. Use MMAP to get more memory from OS
+  if(wmalloc_defrag.count == wmalloc_defrag.capacity){
 
-  Split the memory if the chunk of memory can satisfy the request and 
-  has a usable amount left over as well. Reinsert the split off chunk
-  and return the properly sized chunk
+    uint64_t capacity = wmalloc_defrag.capacity == 0 ? DEFRAG_INDEX_START : wmalloc_defrag.capacity*2;
+    struct defrag_region* regions = mmap(NULL, capacity*sizeof(struct defrag_region), PROT_READ|PROT_WRITE,
+                                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(regions == (void*) -1){
+      return -1;
+    }
+    if(wmalloc_defrag.regions != NULL){
+      memcpy(regions, wmalloc_defrag.regions, wmalloc_defrag.count*sizeof(struct defrag_region));
+      munmap(wmalloc_defrag.regions, wmalloc_defrag.capacity*sizeof(struct defrag_region));
+    }
+    wmalloc_defrag.regions = regions;
+    wmalloc_defrag.capacity = capacity;
+  }
+
+  struct defrag_region* entry = &wmalloc_defrag.regions[wmalloc_defrag.count];
+  entry->first = first;
+  entry->end = end;
+  entry->used = DEFRAG_UNMEASURED;
+  wmalloc_defrag.count++;
+
+  return 1;
+}
+
+/*
+  Orders the regions of the index by address, for qsort
 */
-void* wmalloc(uint64_t request_length){
+int compare_defrag_regions(const void* a, const void* b){
 
-  //initialize malloc struct if first time calling my_malloc
-  if(wmalloc_ptr == NULL){
-    if(initialize_wmalloc() == -1){
-      printf("ERROR in Initializing malloc\n\n");
-      return NULL;
+  uint64_t first_a = (uint64_t)((const struct defrag_region*)a)->first;
+  uint64_t first_b = (uint64_t)((const struct defrag_region*)b)->first;
+
+  return (first_a > first_b) - (first_a < first_b);
+}
+
+/*
+  Returns the region of the index that holds chunk 'ch', found by a
+  binary search, with the bytes in use added up if this scan has not
+  done it yet. NULL if no region holds it.
+  The caller holds the lock of the heap and wmalloc_defrag.lock.
+*/
+struct defrag_region* defrag_region_of(struct wmalloc_info* heap, struct chunk* ch){
+
+  uint64_t low = 0;
+  uint64_t high = wmalloc_defrag.count;
+
+  //the last region that starts at or before 'ch'
+  while(low < high){
+
+    uint64_t middle = (low + high)/2;
+    if((uint64_t)wmalloc_defrag.regions[middle].first <= (uint64_t)ch){
+      low = middle + 1;
     }
+    else{
+      high = middle;
+    }
+  }
+  if(low == 0){
+    return NULL;
+  }
+  
+  struct defrag_region* entry = &wmalloc_defrag.regions[low - 1];
+  if((uint64_t)ch >= entry->end){
+    return NULL;
   }
+  if(entry->used == DEFRAG_UNMEASURED){
+    entry->used = region_usage(heap, entry->first);
+  }
+  return entry;
+}
 
-  uint64_t necessary_length = request_length + CHUNK_OVERHEAD;
+/*
+  Add up the bytes in use in the region that starts with chunk
+  'first'.
+  The caller holds the lock.
+*/
+uint64_t region_usage(struct wmalloc_info* heap, struct chunk* first){
 
-  //if requesting less than the minimum reset to minimum
-  if(necessary_length < MINIMUM_CHUNK_SIZE){
+  uint64_t used = 0;
+  struct chunk* ch = first;
+  
+  while(1){
 
-    necessary_length = MINIMUM_CHUNK_SIZE;
+    if(is_chunk_in_use(heap, ch) == 1){
+      used = used + ch->curr_chunk_size;
+    }
+    if(get_next_chunk_size(ch) == 0){
+      break;
+    }
+    ch = get_next_chunk(ch);
   }
+  return used;
+}
 
-  int i = find_bin(necessary_length);
+/*
+  Returns the available chunk a request of 'request_length' bytes
+  would be split off, without taking it out of its bin. Follows the
+  best fit search, the lowest chunk under first fit, and takes the
+  first chunk that fits under the other policies. NULL if the bins
+  have nothing suitable.
+  The caller holds the lock.
+*/
+struct chunk* peek_chunk(struct wmalloc_info* heap, uint64_t request_length){
 
-  struct chunk* to_remove =  search_bin(i, necessary_length);
+  for(int i = find_bin(heap, request_length); i < heap->num_bins; i++){
 
-  //check for a chunk in a bigger bin
-  if(to_remove == NULL){
+    struct chunk* curr = get_right(heap, &heap->dummy[i]);
+    while(curr != NULL){
 
-    to_remove = check_bigger_bins(i);
+      if(chunk_fits(heap, curr, request_length) == 1){
+        return curr;
+      }
+      curr = get_right(heap, curr);
+    }
   }
+  return NULL;
+}
 
-  //request more memory from OS
-  if(to_remove == NULL){
+/*
+  Allocate 'request_length' bytes that are reached through a handle
+  rather than a pointer, so that wmalloc_compact may move them.
+  The memory comes from a heap of its own that only holds handle
+  allocations.
+
+  wmalloc_pin returns the address of the memory and keeps it where
+  it is until wmalloc_unpin. A pointer must not be kept once the
+  handle is unpinned.
+  Returns 0 if no memory is left.
+*/
+wm_handle wmalloc_h(uint64_t request_length){
+
+  pthread_mutex_lock(&wmalloc_handles.lock);
 
-    to_remove =  allocate_chunk(necessary_length);
+  if(wmalloc_handles.heap == NULL){
 
-    split_chunk(to_remove, necessary_length);
+    wmalloc_handles.heap = heap_create();
+    if(wmalloc_handles.heap == NULL){
+      pthread_mutex_unlock(&wmalloc_handles.lock);
+      return 0;
+    }
+    //the small chunk range is not on the list of regions a
+    //compaction walks
+    wmalloc_handles.heap->policy = WMALLOC_BEST_FIT;
   }
-  else{
 
-    split_chunk(to_remove, necessary_length);
+  if(wmalloc_handles.free_list == 0 && grow_handles() == -1){
+    pthread_mutex_unlock(&wmalloc_handles.lock);
+    return 0;
   }
 
-  //add 16 bytes to get to the user pointer
-  uint64_t address = (uint64_t) to_remove;
-  address = address+16;
+  //the handle sits in front of the memory for compaction to find.
+  //Every chunk of the heap is a multiple of 16 bytes, so they all
+  //start and the memory lands 16 byte aligned.
+  uint64_t length = (request_length + HANDLE_HEADER + CHUNK_OVERHEAD + 15) & ~((uint64_t)15);
+  uint64_t* header = heap_alloc(wmalloc_handles.heap, length - CHUNK_OVERHEAD);
+  if(header == NULL){
+    pthread_mutex_unlock(&wmalloc_handles.lock);
+    return 0;
+  }
 
-  void* ret_ptr = (void*) address;
+  wm_handle handle = wmalloc_handles.free_list;
+  struct handle_entry* entry = &wmalloc_handles.entries[handle];
+  
+  wmalloc_handles.free_list = entry->next_free;
+  entry->next_free = 0;
+  entry->pins = 0;
+  entry->ptr = (char*)header + HANDLE_HEADER;
+  *header = handle;
+  
+  pthread_mutex_unlock(&wmalloc_handles.lock);
 
-  return ret_ptr;
+  return handle;
 }
 
-
 /*
-  Use MMAP to get a new chunk of memory from OS
-  Return a block of at least MMAP_SIZE
+  Returns the address of the memory of 'handle' and keeps it from
+  being moved until as many calls to wmalloc_unpin.
 */
-struct chunk* allocate_chunk(uint64_t required_length){
-  
-  void* mmap_ptr = NULL;
+void* wmalloc_pin(wm_handle handle){
 
-  uint64_t mmap_length;
+  pthread_mutex_lock(&wmalloc_handles.lock);
+  
+  struct handle_entry* entry = &wmalloc_handles.entries[handle];
+  entry->pins++;
+  void* ptr = entry->ptr;
   
-  if(required_length <= MMAP_SIZE){
+  pthread_mutex_unlock(&wmalloc_handles.lock);
 
-    mmap_length = MMAP_SIZE;
+  return ptr;
+}
+
+/*
+  Let the memory of 'handle' be moved again
+*/
+void wmalloc_unpin(wm_handle handle){
+
+  pthread_mutex_lock(&wmalloc_handles.lock);
+
+  struct handle_entry* entry = &wmalloc_handles.entries[handle];
+  if(entry->pins == 0){
+    printf("wmalloc: handle %lu is not pinned\n", handle);
   }
   else{
-    //set to the smallest multiple of PAGE_SIZE that exceeds request_size
-    mmap_length= (required_length/PAGE_SIZE+1)*PAGE_SIZE;
+    entry->pins--;
   }
+  
+  pthread_mutex_unlock(&wmalloc_handles.lock);
+  return;
+}
 
-  mmap_ptr = mmap(NULL, mmap_length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+/*
+  Free the memory of 'handle'. The handle may be given out again.
+*/
+void wfree_h(wm_handle handle){
 
-  if(mmap_ptr == (void*) -1){
-    printf("\n\nmmap failed\n\n");
-    return NULL;
+  if(handle == 0){
+    return;
   }
- 
-  //cast the return of mmap to struct 'chunk'
-  struct chunk* new_chunk = (struct chunk*) mmap_ptr;
-    
-  set_prev_chunk_size(new_chunk, 0);
-  new_chunk -> curr_chunk_size = mmap_length;
-  set_next_chunk_size(new_chunk, 0);
   
-  return new_chunk;
-}
+  pthread_mutex_lock(&wmalloc_handles.lock);
+
+  struct handle_entry* entry = &wmalloc_handles.entries[handle];
+  heap_free(wmalloc_handles.heap, (char*)entry->ptr - HANDLE_HEADER);
 
+  entry->ptr = NULL;
+  entry->pins = 0;
+  entry->next_free = wmalloc_handles.free_list;
+  wmalloc_handles.free_list = handle;
+  
+  pthread_mutex_unlock(&wmalloc_handles.lock);
+  return;
+}
 
 /*
-  Split the chunk if possible. 
-  Return split chunk to storage bins in proper place
+  Slide the unpinned handle allocations in each region down over the
+  available chunks in front of them, so that the available space of
+  a region ends up in one chunk at its end. Pinned allocations stay
+  where they are and the sliding goes on after them. The available
+  pages are then given back with heap_trim, and regions left empty
+  are unmapped.
+
+  Allocations and pins of handles wait for the compaction to finish.
+  Returns the number of bytes given back.
 */
-void split_chunk(struct chunk* to_remove, uint64_t required_length){
+uint64_t wmalloc_compact(){
 
-  assert(to_remove != NULL);
-  
-  if(to_remove->curr_chunk_size >= required_length + MINIMUM_CHUNK_SIZE){
+  pthread_mutex_lock(&wmalloc_handles.lock);
 
-    uint64_t next_chunk_size = to_remove->curr_chunk_size - required_length;
-    uint64_t save_chunk_size = get_next_chunk_size(to_remove);
-    
-    to_remove->curr_chunk_size = required_length;
-    set_next_chunk_size(to_remove, next_chunk_size);
+  struct wmalloc_info* heap = wmalloc_handles.heap;
+  if(heap == NULL){
+    pthread_mutex_unlock(&wmalloc_handles.lock);
+    return 0;
+  }
+  
+  lock_wmalloc(heap);
 
-    char* char_ptr = (char*)to_remove;
+  //the regions carved from a span are not linked, they follow one
+  //another from SPAN_FIRST_REGION
+  if(heap->span_capacity != 0){
 
-    struct chunk* new_chunk = (struct chunk*)(char_ptr + to_remove->curr_chunk_size);
-    new_chunk->curr_chunk_size = next_chunk_size;
-    set_prev_chunk_size(new_chunk, to_remove->curr_chunk_size);
-    set_next_chunk_size(new_chunk, save_chunk_size);
+    for(uint64_t offset = SPAN_FIRST_REGION; offset < heap->span_top;
+        offset = offset + ((struct region*)((uint64_t)heap + offset))->size){
+      compact_region(heap, (struct region*)((uint64_t)heap + offset));
+    }
+  }
+  else{
 
-    set_available(new_chunk);
-    add_chunk(new_chunk);
-    set_adjacent_sizes(to_remove, 1);
+    struct region* curr = heap->regions.next;
+    while(curr != &heap->regions){
+      compact_region(heap, curr);
+      curr = curr->next;
+    }
   }
+  
+  unlock_wmalloc(heap);
+  
+  uint64_t released = heap_trim(heap, 0);
+  
+  pthread_mutex_unlock(&wmalloc_handles.lock);
 
-  set_unavailable(to_remove);
+  return released;
+}
+
+/*
+  Slide the unpinned handle allocations of one region down, walking
+  it by its boundary tags.
+  The caller holds the lock and wmalloc_handles.lock.
+*/
+void compact_region(struct wmalloc_info* heap, struct region* curr){
+
+  struct chunk* ch = (struct chunk*)(curr + 1);
+  while(get_next_chunk_size(ch) != 0){
 
+    struct chunk* next = get_next_chunk(ch);
+
+    //only an allocation in use right after an available chunk moves,
+    //and its header has to name a handle of the table
+    if(is_chunk_in_use(heap, ch) == 0 && is_chunk_in_use(heap, next) == 1){
+
+      uint64_t handle = *(uint64_t*)((char*)next + 16);
+      if(handle == 0 || handle >= wmalloc_handles.capacity){
+        printf("wmalloc: chunk %p has no handle, not compacted\n", (void*)next);
+      }
+      else if(wmalloc_handles.entries[handle].pins == 0){
+        next = slide_chunk(heap, ch, next);
+        wmalloc_handles.entries[handle].ptr = (char*)ch + 16 + HANDLE_HEADER;
+      }
+    }
+    ch = next;
+  }
   return;
 }
 
 /*
-  Remove the chunk from the linked list
+  Move chunk 'in_use' down to the start of the available chunk 'gap'
+  right in front of it. The two are joined into one chunk in use, its
+  contents copied to the front and the rest split off and freed,
+  which joins it to an available chunk that follows.
+  Returns the chunk that ends up after the moved one.
+  The caller holds the lock.
 */
-struct chunk* remove_chunk(struct chunk* to_remove){
+struct chunk* slide_chunk(struct wmalloc_info* heap, struct chunk* gap, struct chunk* in_use){
 
-  struct chunk* left_neighbor = to_remove->left_ptr;
-  struct chunk* right_neighbor = to_remove->right_ptr;
+  uint64_t length = in_use->curr_chunk_size;
+  uint64_t tag = in_use->prev_chunk_size & TAG_MASK;
+  
+  remove_chunk(heap, gap);
 
-  if(right_neighbor == NULL){
+  //the contents end before the size at the end of the chunk
+  memmove((char*)gap + 16, (char*)in_use + 16, length - CHUNK_OVERHEAD);
 
-    left_neighbor->right_ptr = NULL;
-  }
+  gap->curr_chunk_size = gap->curr_chunk_size + length;
+  gap->prev_chunk_size = (gap->prev_chunk_size & ~((uint64_t)TAG_MASK)) | tag;
+
+  //the joined chunk is still marked available to the chunk in front,
+  //split_chunk writes its new size there and flips it to in use. It
+  //always splits since 'gap' is at least MINIMUM_CHUNK_SIZE.
+  split_chunk(heap, gap, length);
+
+  //the split off chunk went to its bin without joining the next one
+  struct chunk* rest = get_next_chunk(gap);
+  remove_chunk(heap, rest);
   
-  else{
+  return free_chunk(heap, rest);
+}
+
+/*
+  Make room for more handles. Handle 0 is never given out.
+  The caller holds wmalloc_handles.lock.
+  Returns -1 if the table could not be mapped.
+*/
+int grow_handles(){
+
+  uint64_t capacity = wmalloc_handles.capacity == 0 ? HANDLES_START : wmalloc_handles.capacity*2;
 
-    left_neighbor->right_ptr = right_neighbor;
-    right_neighbor->left_ptr = left_neighbor;
+  struct handle_entry* entries = mmap(NULL, capacity*sizeof(struct handle_entry), PROT_READ|PROT_WRITE,
+                                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(entries == (void*) -1){
+    printf("wmalloc: could not map %lu handles\n", capacity);
+    return -1;
   }
 
-  //set 'to_remove' ptrs to NULL to avoid dangling references
-  to_remove->right_ptr = NULL;
-  to_remove->left_ptr = NULL;
-   
-  return to_remove;
+  uint64_t first = 1;
+  if(wmalloc_handles.entries != NULL){
+    memcpy(entries, wmalloc_handles.entries, wmalloc_handles.capacity*sizeof(struct handle_entry));
+    munmap(wmalloc_handles.entries, wmalloc_handles.capacity*sizeof(struct handle_entry));
+    first = wmalloc_handles.capacity;
+  }
+
+  //the new handles go on the free list lowest first
+  for(uint64_t i=capacity-1; i>=first; i--){
+    entries[i].next_free = wmalloc_handles.free_list;
+    wmalloc_handles.free_list = i;
+  }
+  
+  wmalloc_handles.entries = entries;
+  wmalloc_handles.capacity = capacity;
+  
+  return 1;
 }
 
 /*
-  If possible join the freed chunk with prev and next chunks.
-  Then return to proper bin in the linked list 
-*/  
-void wfree(void* to_free){
+  Create a heap in a cage, WMALLOC_CAGE_SIZE bytes of address space
+  reserved at once. Everything allocated from it lies inside the cage,
+  so a pointer to it can be stored in 32 bits with wmalloc_compress
+  and turned back with wmalloc_decompress. Pages are only backed once
+  they are used.
+
+  Allocate with heap_alloc, free with heap_free and unmap the cage
+  with wmalloc_cage_destroy.
+  Returns NULL if the address space cannot be reserved.
+*/
+wmalloc_heap_t wmalloc_cage_create(){
 
-  //subtract 16 bytes from 'to_free' and cast to struct 'chunk'
-  uint64_t address = (uint64_t)(to_free);
-  address = address-16;
+  if(wmalloc_ptr == NULL){
+    if(initialize_wmalloc() == -1){
+      return NULL;
+    }
+  }
 
-  struct chunk* ch = (struct chunk*) address;
+  void* space = map_cage();
+  if(space == (void*) -1){
+    printf("wmalloc: could not reserve a cage\n");
+    return NULL;
+  }
 
-  //update prev and next chunks to reflect ch new status as available
-  set_available(ch);
+  struct wmalloc_info* heap = (struct wmalloc_info*) space;
+  initialize_span_heap(heap, WMALLOC_CAGE_SIZE);
+  heap->magic = WMALLOC_CAGE_MAGIC;
+  
+  return heap;
+}
 
-  if(is_prev_available(ch) == 1){
-    
-    struct chunk* prev_chunk = remove_chunk(get_prev_chunk(ch));
-    ch = join_chunks(prev_chunk, ch);
-    
+/*
+  Run wmalloc and wfree in a cage, see wmalloc_cage_create. Returns
+  the heap of the cage to compress and decompress pointers with.
+
+  Has to come before the first call to wmalloc, as with
+  wmalloc_init_with_buffer.
+  Returns NULL if wmalloc was in use already or the address space
+  cannot be reserved.
+*/
+wmalloc_heap_t wmalloc_init_cage(){
+
+  void* space = map_cage();
+  if(space == (void*) -1){
+    printf("wmalloc: could not reserve a cage\n");
+    return NULL;
   }
-  if(is_next_available(ch) == 1){
-   
-    struct chunk* next_chunk = remove_chunk(get_next_chunk(ch));
-    ch = join_chunks(ch, next_chunk);
+
+  if(wmalloc_init_with_buffer(space, WMALLOC_CAGE_SIZE) == -1){
+    munmap(space, WMALLOC_CAGE_SIZE);
+    return NULL;
+  }
+  return wmalloc_ptr;
+}
+
+/*
+  Unmap a cage from wmalloc_cage_create along with everything
+  allocated in it
+*/
+void wmalloc_cage_destroy(wmalloc_heap_t cage){
+
+  if(cage == NULL || cage->magic != WMALLOC_CAGE_MAGIC){
+    printf("wmalloc: wmalloc_cage_destroy needs a cage\n");
+    return;
   }
 
-  add_chunk(ch);
+  //the hooks saw each region as it was carved
+  for(uint64_t offset = SPAN_FIRST_REGION; offset < cage->span_top;
+      offset = offset + ((struct region*)((uint64_t)cage + offset))->size){
+    struct region* curr = (struct region*)((uint64_t)cage + offset);
+    WMALLOC_HOOK(region_unmap, cage, curr, curr->size);
+  }
   
+  munmap(cage, WMALLOC_CAGE_SIZE);
   return;
 }
 
+/*
+  Reserve the address space of a cage. Pages are backed as they are
+  touched. Returns (void*) -1 if mmap fails.
+*/
+void* map_cage(){
+
+  return mmap(NULL, WMALLOC_CAGE_SIZE, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+}
 
 /*
-  Joins two chunks of memory that are adjacent
-  'first' comes first in memory followed by 'second'
+  Returns the 32 bit reference to 'ptr' in the cage, 0 for NULL
 */
- 
-struct chunk* join_chunks(struct chunk* first, struct chunk* second){
+uint32_t wmalloc_compress(wmalloc_heap_t cage, void* ptr){
 
-  uint64_t total_length = first->curr_chunk_size + second->curr_chunk_size;
-  first->curr_chunk_size = total_length;
+  if(ptr == NULL){
+    return 0;
+  }
 
-  set_adjacent_sizes(first, 1);
+  uint64_t offset = (uint64_t)ptr - (uint64_t)cage;
+  assert(offset < WMALLOC_CAGE_SIZE);
+  
+  return (uint32_t)offset;
+}
 
-  return first;
+/*
+  Returns the pointer for a reference from wmalloc_compress
+*/
+void* wmalloc_decompress(wmalloc_heap_t cage, uint32_t ref){
+
+  if(ref == 0){
+    return NULL;
+  }
+  return (void*)((uint64_t)cage + ref);
 }
- 
+
 #endif /*WMALLOC*/
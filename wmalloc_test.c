@@ -25,6 +25,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "wmalloc.h"
 
 
@@ -36,12 +44,12 @@ uint64_t calc_mem_available(){
 
     uint64_t total=0;
   struct chunk* curr;
-  for(int i=0; i<NUM_BINS; i++){
+  for(int i=0; i<wmalloc_ptr->num_bins; i++){
     
-    curr = wmalloc_ptr->bin[i]->right_ptr;
+    curr = get_right(wmalloc_ptr, &wmalloc_ptr->dummy[i]);
     while(curr != NULL){
       total = total + curr->curr_chunk_size;
-      curr = curr->right_ptr;
+      curr = get_right(wmalloc_ptr, curr);
     }
   }
   return total;
@@ -54,18 +62,31 @@ uint64_t calc_mem_available(){
 void print_available(){
 
   struct chunk* curr;
-  for(int i=0; i<NUM_BINS; i++){
+  for(int i=0; i<wmalloc_ptr->num_bins; i++){
     printf("less than %lu - ", wmalloc_ptr->bin_index[i]);
-    curr = wmalloc_ptr->bin[i]->right_ptr;
+    curr = get_right(wmalloc_ptr, &wmalloc_ptr->dummy[i]);
     while(curr != NULL){
       printf(" %lu", curr->curr_chunk_size);
-      curr = curr->right_ptr;
+      curr = get_right(wmalloc_ptr, curr);
     }
     printf("\n");
   }
   return;
 }
 
+/*
+  Stops the run with 'what' if 'ok' is 0. wmalloc.h defines NDEBUG, so
+  assert does not do this.
+*/
+void expect(int ok, const char* what){
+
+  if(ok == 0){
+    printf("FAILED: %s \n", what);
+    exit(1);
+  }
+  return;
+}
+
 /*
   Allocate memory for 5000 of 10000 pointer array.
   Then "flip a coin" to determine whether to add another chunk or
@@ -182,40 +203,1681 @@ void std_test2(){
   free(array);
 }
 
-int main(){
+/*
+  Benchmark the placement policies. The same sequence of requests is
+  run under each on a new heap: a mix of small and page sized
+  requests, 5000 live at first and then a coin flip between
+  allocating and freeing a random one. Reports the time taken and the
+  fragmentation as the most memory mapped from the OS over the most
+  requested by the test at any one time.
+*/
+void wmalloc_policy_test(){
 
-  srand(time(NULL));
- 
-  clock_t t;
-  double time_taken;
-   
-  t = clock(); 
-  wmalloc_test1(); 
-  t = clock() - t; 
-  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  const char* names[] = {"best fit", "first fit", "next fit", "LIFO", "segregated"};
+  int policies[] = {WMALLOC_BEST_FIT, WMALLOC_FIRST_FIT, WMALLOC_NEXT_FIT,
+                    WMALLOC_LIFO, WMALLOC_SEGREGATED};
+
+  void* array[10000];
+  uint64_t sizes[10000];
+  double fragmentation[5];
+
+  wmalloc(0);
+  int saved_policy = wmalloc_ptr->policy;
   
-  printf("wmalloc_test1() took %f seconds to execute \n", time_taken);
+  for(int p=0; p<5; p++){
 
-  t = clock(); 
-  std_test1(); 
-  t = clock() - t; 
-  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+    //a heap starts with the policy of the default heap. Regions of a
+    //span stay mapped, so each policy gets a heap of its own.
+    wmalloc_set_policy(policies[p]);
+    wmalloc_heap_t heap = heap_create();
+    expect(heap != NULL, "policy heap created");
+    expect(heap->policy == policies[p] || heap->span_capacity != 0, "policy applied");
+    srand(1);
+
+    uint64_t live = 0;
+    uint64_t peak_live = 0;
+    uint64_t peak_mapped = 0;
+    int index = 0;
+    
+    clock_t t = clock();
+    
+    for(int i=0; i<200000; i++){
+
+      //fill up to 5000 chunks first then flip a coin
+      if(index == 10000 || (i >= 5000 && index > 0 && rand()%2 == 0)){
+
+        int victim = rand()%index;
+        heap_free(heap, array[victim]);
+        live = live - sizes[victim];
+        
+        index--;
+        array[victim] = array[index];
+        sizes[victim] = sizes[index];
+      }
+      else{
+
+        //mostly small requests with some of a page or more
+        uint64_t r = (rand()%4 == 0) ? rand()%0x2000 : rand()%256;
+        array[index] = heap_alloc(heap, r);
+        sizes[index] = r;
+        live = live + r;
+        index++;
+      }
+
+      if(live > peak_live){
+        peak_live = live;
+      }
+      if(heap->stats.mapped_bytes > peak_mapped){
+        peak_mapped = heap->stats.mapped_bytes;
+      }
+    }
+    
+    for(int i=0; i<index; i++){
+      heap_free(heap, array[i]);
+    }
+    
+    t = clock() - t;
+    fragmentation[p] = (double)peak_mapped/peak_live;
+    heap_destroy(heap);
+
+    printf("%-10s took %f seconds, fragmentation %.3f \n", names[p],
+           ((double)t)/CLOCKS_PER_SEC, fragmentation[p]);
+    expect(fragmentation[p] >= 1.0 && fragmentation[p] < 2.0, "policy fragmentation in range");
+  }
+
+  //best fit and first fit order the bins differently
+  expect(fragmentation[0] != fragmentation[1], "policies place chunks differently");
   
-  printf("std_test1() took %f seconds to execute \n", time_taken);
+  wmalloc_set_policy(saved_policy);
+  
+  return;
+}
 
-  t = clock(); 
-  wmalloc_test2(); 
-  t = clock() - t; 
-  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+/*
+  Purges a chunk, hands it out whole again and dirties it. Once it
+  is freed trimming has to find its pages again.
+*/
+void wmalloc_purge_test(){
+
+  wmalloc_heap_t heap = heap_create();
+
+  //the chunks around keep the region mapped
+  void* before = heap_alloc(heap, 2000);
+  char* chunk = heap_alloc(heap, 65536);
+  void* after = heap_alloc(heap, 2000);
+  void* rest = heap_alloc(heap, 131072 - 65536 - 8000);
+
+  heap_free(heap, chunk);
+  uint64_t first = heap_trim(heap, 0);
+
+  char* again = heap_alloc(heap, 65536);
+  memset(again, 1, 65536);
+  heap_free(heap, again);
+  uint64_t second = heap_trim(heap, 0);
+
+  printf("purge: first trim released %lu bytes, the same chunk %s after reuse %s\n",
+         first, again == chunk ? "handed out" : "not handed out", second > 0 ? "released again" : "NOT released");
+  expect(first > 0 && again == chunk && second > 0, "purged chunk released again after reuse");
+
+  heap_free(heap, before);
+  heap_free(heap, after);
+  heap_free(heap, rest);
+  heap_destroy(heap);
+  return;
+}
+
+/*
+  Run a mix of small and large requests on a heap of its own and
+  throw the whole heap away without freeing anything.
+*/
+void wmalloc_heap_test(){
+
+  uint64_t default_mapped = wmalloc_ptr->stats.mapped_bytes;
+  wmalloc_heap_t heap = heap_create();
+  expect(heap != NULL, "heap_create");
+
+  void* array[10000];
   
-  printf("wmalloc_test2() took %f seconds to execute \n", time_taken);
+  for(int i=0; i<10000; i++){
 
-  t = clock(); 
-  std_test2(); 
-  t = clock() - t; 
-  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+    uint64_t r = (i%100 == 0) ? rand()%0x40000 : rand()%0x400;
+    array[i] = heap_alloc(heap, r);
+    memset(array[i], 0xab, r);
+  }
+  for(int i=0; i<10000; i=i+2){
+    heap_free(heap, array[i]);
+  }
   
-  printf("std_test2() took %f seconds to execute \n", time_taken);
+  uint64_t mapped = heap->stats.mapped_bytes;
+  
+  heap_destroy(heap);
+
+  printf("heap with %lu bytes mapped destroyed, default heap untouched: %lu bytes mapped \n",
+         mapped, wmalloc_ptr->stats.mapped_bytes);
+  expect(mapped > 0 && wmalloc_ptr->stats.mapped_bytes == default_mapped, "heap kept apart from the default heap");
+  return;
+}
+
+/*
+  Build a list in a persistent heap, close it and open it again. The
+  list is found again from the root without being rebuilt. The links
+  are stored as offsets.
+*/
+struct pheap_node{
+
+  uint64_t next;
+  uint64_t key;
+};
+
+void wmalloc_pheap_test(){
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/wmalloc_test.%d.pheap", getpid());
+  unlink(path);
+  
+  clock_t t = clock();
+  
+  wmalloc_heap_t heap = wmalloc_pheap_open(path);
+  expect(heap != NULL, "wmalloc_pheap_open");
+
+  uint64_t sum = 0;
+  struct pheap_node* head = NULL;
+  
+  for(uint64_t i=0; i<100000; i++){
+
+    struct pheap_node* node = heap_alloc(heap, sizeof(struct pheap_node) + rand()%64);
+    node->key = i;
+    node->next = heap_offset(heap, head);
+    head = node;
+    sum = sum + i;
+  }
+  wmalloc_pheap_set_root(heap, head);
+  wmalloc_pheap_close(heap);
+
+  double build_time = ((double)(clock() - t))/CLOCKS_PER_SEC;
+  t = clock();
+  
+  heap = wmalloc_pheap_open(path);
+  expect(heap != NULL, "wmalloc_pheap_open again");
+
+  double open_time = ((double)(clock() - t))/CLOCKS_PER_SEC;
+  
+  uint64_t found = 0;
+  uint64_t count = 0;
+  struct pheap_node* node = wmalloc_pheap_root(heap);
+  
+  while(node != NULL){
+    found = found + node->key;
+    count++;
+    node = heap_pointer(heap, node->next);
+  }
+
+  //the heap is still usable after reopening
+  heap_free(heap, heap_alloc(heap, 100));
+  
+  wmalloc_pheap_close(heap);
+  unlink(path);
+  
+  printf("persistent heap: built %lu nodes in %f seconds, reopened in %f seconds, %s \n",
+         count, build_time, open_time, found == sum ? "contents intact" : "CONTENTS LOST");
+  expect(count == 100000 && found == sum, "persistent heap contents kept");
+  return;
+}
+
+/*
+  Worker processes fill buffers in a shared heap and hand them to the
+  parent by offset through a pipe. The parent checks and frees them.
+*/
+void wmalloc_shared_test(){
+
+  wmalloc_heap_t heap = wmalloc_shared_create(NULL, 0x10000000);
+  expect(heap != NULL, "wmalloc_shared_create");
+
+  int fds[2];
+  if(pipe(fds) == -1){
+    wmalloc_shared_detach(heap);
+    return;
+  }
+  
+  int workers = 4;
+  int buffers = 200;
+  uint64_t size = 0x10000;
+  
+  for(int w=0; w<workers; w++){
+
+    if(fork() == 0){
+
+      close(fds[0]);
+      for(int i=0; i<buffers; i++){
+
+        char* buffer = heap_alloc(heap, size);
+        memset(buffer, 'a'+w, size);
+        
+        uint64_t offset = heap_offset(heap, buffer);
+        if(write(fds[1], &offset, sizeof(offset)) != sizeof(offset)){
+          _exit(1);
+        }
+      }
+      _exit(0);
+    }
+  }
+  close(fds[1]);
+
+  int received = 0;
+  int intact = 0;
+  uint64_t offset;
+  
+  while(read(fds[0], &offset, sizeof(offset)) == sizeof(offset)){
+
+    char* buffer = heap_pointer(heap, offset);
+    if(buffer[0] >= 'a' && buffer[0] < 'a'+workers && buffer[size-1] == buffer[0]){
+      intact++;
+    }
+    heap_free(heap, buffer);
+    received++;
+  }
+  close(fds[0]);
+  
+  for(int w=0; w<workers; w++){
+    wait(NULL);
+  }
+
+  printf("shared heap: %d of %d buffers from %d processes passed by offset intact \n",
+         intact, received, workers);
+  expect(received == workers*buffers && intact == received, "shared buffers intact");
+  
+  wmalloc_shared_detach(heap);
+  return;
+}
+
+/*
+  Learn the size classes from a workload with sharp peaks in its
+  request sizes and report the expected internal fragmentation with
+  the old and the learned bins.
+*/
+void wmalloc_learn_test(){
+
+  uint64_t peaks[] = {200, 600, 1500, 3000, 5000};
+  void* array[1000];
+
+  wmalloc_learn_size_classes(5000);
+  
+  for(int round=0; round<5; round++){
+    for(int i=0; i<1000; i++){
+      array[i] = wmalloc(peaks[rand()%5]);
+    }
+    for(int i=0; i<1000; i++){
+      wfree(array[i]);
+    }
+  }
+
+  struct wmalloc_size_class_report report;
+  expect(wmalloc_size_class_report(&report) != -1, "size classes learned");
+  printf("learned %d size classes from %lu requests, %d bins -> %d bins \n",
+         report.peaks, report.samples, report.old_bins, report.new_bins);
+  printf("average bytes to the top of the bin %.1f -> %.1f \n",
+         report.old_waste, report.new_waste);
+  expect(report.peaks > 0 && report.new_bins > report.old_bins && report.new_waste < report.old_waste,
+         "learned size classes waste less");
+  return;
+}
+
+/*
+  Counts what the hooks see on a heap of its own and checks
+  the counts add up
+*/
+struct hook_counts{
+  uint64_t pre_alloc;
+  uint64_t post_alloc;
+  uint64_t pre_free;
+  uint64_t mapped;
+  uint64_t unmapped;
+};
+
+void count_pre_alloc(wmalloc_heap_t heap, uint64_t request_length, void* arg){
+  ((struct hook_counts*)arg)->pre_alloc++;
+}
+
+void count_post_alloc(wmalloc_heap_t heap, void* ptr, uint64_t request_length, void* arg){
+  ((struct hook_counts*)arg)->post_alloc++;
+}
+
+void count_pre_free(wmalloc_heap_t heap, void* ptr, void* arg){
+  ((struct hook_counts*)arg)->pre_free++;
+}
+
+void count_map(wmalloc_heap_t heap, void* start, uint64_t length, void* arg){
+  ((struct hook_counts*)arg)->mapped += length;
+}
+
+void count_unmap(wmalloc_heap_t heap, void* start, uint64_t length, void* arg){
+  ((struct hook_counts*)arg)->unmapped += length;
+}
+
+void wmalloc_hooks_test(){
+
+  struct hook_counts counts;
+  memset(&counts, 0, sizeof(struct hook_counts));
+
+  struct wmalloc_hooks hooks = {
+    .pre_alloc = count_pre_alloc,
+    .post_alloc = count_post_alloc,
+    .pre_free = count_pre_free,
+    .region_map = count_map,
+    .region_unmap = count_unmap,
+    .arg = &counts
+  };
+  wmalloc_set_hooks(&hooks);
+
+  wmalloc_heap_t heap = heap_create();
+  void* array[10000];
+  
+  for(int i=0; i<10000; i++){
+    array[i] = heap_alloc(heap, (i%100 == 0) ? rand()%0x40000 : rand()%0x400);
+  }
+  for(int i=0; i<10000; i++){
+    heap_free(heap, array[i]);
+  }
+  heap_destroy(heap);
+  
+  wmalloc_set_hooks(NULL);
+
+  printf("hooks: %lu allocs, %lu returned, %lu frees, %lu bytes mapped, %lu unmapped \n",
+         counts.pre_alloc, counts.post_alloc, counts.pre_free, counts.mapped, counts.unmapped);
+  expect(counts.pre_alloc == 10000 && counts.post_alloc == 10000 && counts.pre_free == 10000,
+         "hooks saw every call");
+  expect(counts.mapped > 0 && counts.mapped == counts.unmapped, "hooks saw every region");
+  return;
+}
+
+/*
+  Threads allocate buffers under two tags, the second with a limit,
+  and the main thread frees them. The usage has to drop back to 0.
+*/
+#define TAG_BUFFERS 1
+#define TAG_CACHE 2
+
+void* tag_worker(void* arg){
+
+  void** array = (void**) arg;
+
+  for(int i=0; i<1000; i++){
+    array[i] = wmalloc_tagged(1000, (i%2 == 0) ? TAG_BUFFERS : TAG_CACHE);
+  }
+  return NULL;
+}
+
+void wmalloc_tags_test(){
+
+  static void* array[4][1000];
+  pthread_t threads[4];
+
+  wmalloc_tag_limit(TAG_CACHE, 1000*1024);
+
+  //shares the default heap before the threads start
+  wfree(wmalloc_tagged(1000, TAG_BUFFERS));
+  
+  for(int i=0; i<4; i++){
+    pthread_create(&threads[i], NULL, tag_worker, array[i]);
+  }
+  for(int i=0; i<4; i++){
+    pthread_join(threads[i], NULL);
+  }
+
+  int refused = 0;
+  for(int i=0; i<4; i++){
+    for(int j=0; j<1000; j++){
+      if(array[i][j] == NULL){
+        refused++;
+      }
+    }
+  }
+  
+  printf("tags: buffers hold %lu bytes, cache %lu bytes with %d requests over its limit refused \n",
+         wmalloc_tag_usage(TAG_BUFFERS), wmalloc_tag_usage(TAG_CACHE), refused);
+  //the limit is soft, each thread may be one request past it
+  expect(wmalloc_tag_usage(TAG_BUFFERS) >= 2000*1000 && wmalloc_tag_usage(TAG_CACHE) <= (1000 + 4)*1024,
+         "tag usage counted");
+  expect(refused > 0, "tag limit refuses requests");
+
+  for(int i=0; i<4; i++){
+    for(int j=0; j<1000; j++){
+      if(array[i][j] != NULL){
+        wfree(array[i][j]);
+      }
+    }
+  }
+
+  printf("tags: after freeing buffers hold %lu bytes, cache %lu bytes \n",
+         wmalloc_tag_usage(TAG_BUFFERS), wmalloc_tag_usage(TAG_CACHE));
+  expect(wmalloc_tag_usage(TAG_BUFFERS) == 0 && wmalloc_tag_usage(TAG_CACHE) == 0, "tag usage back to 0");
+  return;
+}
+
+/*
+  Dump the default heap and check that the chunks of every region
+  add up to the region, as they should when the boundary tags are
+  walked right
+*/
+void wmalloc_dump_test(){
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/wmalloc_test.%d.dump", getpid());
+  void* array[10000];
+  
+  for(int i=0; i<10000; i++){
+    array[i] = wmalloc(rand()%0x800);
+  }
+  for(int i=0; i<10000; i=i+3){
+    wfree(array[i]);
+  }
+
+  int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  expect(fd != -1 && wmalloc_dump_heap(fd) != -1, "heap dump written");
+
+  uint64_t size = lseek(fd, 0, SEEK_END);
+  uint64_t* words = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  uint64_t count = size/sizeof(uint64_t);
+  uint64_t regions = 0;
+  uint64_t chunks = 0;
+  uint64_t broken = 0;
+  uint64_t covered = 0;
+  uint64_t expected = 0;
+  
+  for(uint64_t i = 3 + words[2]; i < count && words[i] != DUMP_END; i++){
+
+    if((words[i] & 0xff00000000000000) == DUMP_REGION){
+
+      if(covered != expected){
+        broken++;
+      }
+      uint64_t header = ((words[i] & 0xff) == DUMP_REGION_SMALL) ? 0 : sizeof(struct region);
+      uint64_t colour = (words[i] >> 8) & 0xffff;
+      expected = words[i+2] - header - colour;
+      covered = 0;
+      regions++;
+      i = i + 2;
+      continue;
+    }
+    covered = covered + (words[i] & SIZE_MASK);
+    chunks++;
+  }
+  if(covered != expected){
+    broken++;
+  }
+  
+  munmap(words, size);
+  unlink(path);
+
+  for(int i=1; i<10000; i++){
+    if(i%3 != 0){
+      wfree(array[i]);
+    }
+  }
+
+  printf("heap dump: %lu regions, %lu chunks, %lu regions not covered by their chunks \n",
+         regions, chunks, broken);
+  expect(regions > 0 && chunks >= regions && broken == 0, "heap dump covers every region");
+  return;
+}
+
+/*
+  Turn on more NUMA arenas than there are nodes so threads on
+  different CPUs use different arenas even on one node. Each thread
+  frees the buffers of the next one, and every free has to go back to
+  the arena the buffer came from.
+*/
+void* arena_worker(void* arg){
+
+  void** array = (void**) arg;
+
+  for(int i=0; i<5000; i++){
+    array[i] = wmalloc(16 + rand()%2000 + (i%500 == 0 ? 0x40000 : 0));
+    memset(array[i], 0xcd, 16);
+  }
+  return NULL;
+}
+
+void* arena_freer(void* arg){
+
+  void** array = (void**) arg;
+
+  for(int i=0; i<5000; i++){
+    wfree(array[i]);
+  }
+  return NULL;
+}
+
+void wmalloc_arena_test(){
+
+  static void* array[8][5000];
+  pthread_t threads[8];
+
+  int count = wmalloc_numa_arenas(4);
+
+  for(int i=0; i<8; i++){
+    pthread_create(&threads[i], NULL, arena_worker, array[i]);
+  }
+  for(int i=0; i<8; i++){
+    pthread_join(threads[i], NULL);
+  }
+  for(int i=0; i<8; i++){
+    pthread_create(&threads[i], NULL, arena_freer, array[(i+1)%8]);
+  }
+  for(int i=0; i<8; i++){
+    pthread_join(threads[i], NULL);
+  }
+
+  int used = 0;
+  int balanced = 1;
+  for(int i=0; i<count; i++){
+    struct wmalloc_info* arena = wmalloc_arenas.heap[i];
+    if(arena->stats.allocs > 0){
+      used++;
+    }
+    if(arena->stats.allocs != arena->stats.frees || arena->stats.in_use_bytes != 0){
+      balanced = 0;
+    }
+  }
+  
+  //the dump holds the default heap and then each arena
+  FILE* dump = tmpfile();
+  int heaps = 0;
+  uint64_t word;
+  expect(dump != NULL && wmalloc_dump_heap(fileno(dump)) == 1, "arena heap dump written");
+  rewind(dump);
+  while(fread(&word, sizeof(uint64_t), 1, dump) == 1){
+    if(word == WMALLOC_DUMP_MAGIC){
+      heaps++;
+    }
+  }
+  fclose(dump);
+  expect(heaps == wmalloc_arenas.count + 1, "heap dump covers the arenas");
+
+  //a policy switch reaches the arenas as well
+  int policy = wmalloc_ptr->policy;
+  wmalloc_set_policy(WMALLOC_FIRST_FIT);
+  for(int i=0; i<wmalloc_arenas.count; i++){
+    expect(wmalloc_arenas.heap[i]->policy == WMALLOC_FIRST_FIT, "policy applied to the arenas");
+  }
+  wmalloc_set_policy(policy);
+  
+  printf("arenas: %d on %d node(s), %d used, frees went back to their arena: %s, %d heaps dumped \n",
+         count, wmalloc_arenas.nodes, used, balanced ? "yes" : "no", heaps);
+  expect(balanced == 1, "frees went back to their arena");
+#ifndef WMALLOC_COMPACT
+  expect(count > 0 && used > 0, "arenas used");
+#endif
+  return;
+}
+
+/*
+  A lock free stack shared by four threads that pop a node, retire
+  it and push a new one. Popping reads the next pointer of a node that
+  another thread may have popped and retired already, which is only
+  safe because the node is not freed before the reader leaves its
+  critical section.
+*/
+struct stack_node{
+  struct stack_node* next;
+  uint64_t value;
+};
+
+struct stack_node* stack_top = NULL;
+
+void stack_push(struct stack_node* node){
+
+  struct stack_node* top = __atomic_load_n(&stack_top, __ATOMIC_RELAXED);
+  do{
+    node->next = top;
+  }while(!__atomic_compare_exchange_n(&stack_top, &top, node, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return;
+}
+
+struct stack_node* stack_pop(){
+
+  struct stack_node* top = __atomic_load_n(&stack_top, __ATOMIC_ACQUIRE);
+  while(top != NULL &&
+        !__atomic_compare_exchange_n(&stack_top, &top, top->next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+  }
+  return top;
+}
+
+void* stack_worker(void* arg){
+
+  uint64_t* popped = (uint64_t*) arg;
+  
+  for(int i=0; i<100000; i++){
+
+    wmalloc_epoch_enter();
+    struct stack_node* node = stack_pop();
+    wmalloc_epoch_exit();
+    
+    if(node != NULL){
+      (*popped)++;
+      wmalloc_retire(node);
+    }
+
+    struct stack_node* fresh = wmalloc(sizeof(struct stack_node));
+    fresh->value = i;
+    stack_push(fresh);
+  }
+  return NULL;
+}
+
+void wmalloc_retire_test(){
+
+  pthread_t threads[4];
+  uint64_t popped[4] = {0, 0, 0, 0};
+
+  //shares the default heap before the threads start
+  wmalloc_epoch_enter();
+  wmalloc_epoch_exit();
+  
+  for(int i=0; i<4; i++){
+    pthread_create(&threads[i], NULL, stack_worker, &popped[i]);
+  }
+  for(int i=0; i<4; i++){
+    pthread_join(threads[i], NULL);
+  }
+
+  uint64_t left = 0;
+  struct stack_node* node;
+  while((node = stack_pop()) != NULL){
+    wfree(node);
+    left++;
+  }
+  uint64_t waiting = wmalloc_retire_flush();
+  
+  printf("retire: %lu nodes popped and retired, %lu left on the stack, %lu still waiting \n",
+         popped[0] + popped[1] + popped[2] + popped[3], left, waiting);
+  expect(popped[0] + popped[1] + popped[2] + popped[3] + left == 400000, "every node popped once");
+  expect(waiting == 0, "retired nodes freed");
+
+  //one lock per batch rather than per chunk
+  static void* array[100000];
+  for(int i=0; i<100000; i++){
+    array[i] = wmalloc(rand()%200);
+  }
+  clock_t t = clock();
+  wfree_bulk(array, 100000);
+  t = clock() - t;
+  
+  for(int i=0; i<100000; i++){
+    array[i] = wmalloc(rand()%200);
+  }
+  clock_t u = clock();
+  for(int i=0; i<100000; i++){
+    wfree(array[i]);
+  }
+  u = clock() - u;
+
+  printf("100000 frees took %f seconds with wfree_bulk, %f seconds with wfree \n",
+         ((double)t)/CLOCKS_PER_SEC, ((double)u)/CLOCKS_PER_SEC);
+  return;
+}
+
+/*
+  A deep recursion that needs a few temporary buffers at every level,
+  from scratch space and from wmalloc and wfree
+*/
+uint64_t scratch_walk(int depth){
+
+  void* mark = wmalloc_scratch_mark();
+  
+  uint64_t sum = 0;
+  for(int i=0; i<4; i++){
+    uint64_t length = 64 + (depth*37 + i*101)%2000;
+    unsigned char* buffer = wmalloc_scratch_alloc(length);
+    memset(buffer, depth, length);
+    sum = sum + buffer[length-1];
+  }
+  if(depth > 0){
+    sum = sum + scratch_walk(depth-1);
+  }
+
+  wmalloc_scratch_release(mark);
+  return sum;
+}
+
+uint64_t wmalloc_walk(int depth){
+
+  void* buffers[4];
+  
+  uint64_t sum = 0;
+  for(int i=0; i<4; i++){
+    uint64_t length = 64 + (depth*37 + i*101)%2000;
+    unsigned char* buffer = wmalloc(length);
+    memset(buffer, depth, length);
+    sum = sum + buffer[length-1];
+    buffers[i] = buffer;
+  }
+  if(depth > 0){
+    sum = sum + wmalloc_walk(depth-1);
+  }
+
+  for(int i=0; i<4; i++){
+    wfree(buffers[i]);
+  }
+  return sum;
+}
+
+void wmalloc_scratch_test(){
+
+  uint64_t sum = 0;
+  uint64_t check = 0;
+  
+  clock_t t = clock();
+  for(int i=0; i<200; i++){
+    sum = sum + scratch_walk(200);
+  }
+  t = clock() - t;
+
+  clock_t u = clock();
+  for(int i=0; i<200; i++){
+    check = check + wmalloc_walk(200);
+  }
+  u = clock() - u;
+
+  printf("scratch: recursion took %f seconds with scratch space, %f seconds with wmalloc, same results: %s \n",
+         ((double)t)/CLOCKS_PER_SEC, ((double)u)/CLOCKS_PER_SEC, sum == check ? "yes" : "no");
+  expect(sum == check, "scratch and wmalloc give the same results");
+  return;
+}
+
+/*
+  Allocates a burst on a new heap with and without reserving memory
+  first, and counts the mmap calls and page faults of the burst.
+*/
+#define RESERVE_TEST_COUNT 20000
+
+void reserve_burst(wmalloc_heap_t heap, void** ptrs, uint64_t* mmaps, long* faults){
+
+  struct rusage before, after;
+  uint64_t calls = heap->stats.mmap_calls;
+
+  getrusage(RUSAGE_SELF, &before);
+  for(int i=0; i<RESERVE_TEST_COUNT; i++){
+    ptrs[i] = heap_alloc(heap, 1000);
+    memset(ptrs[i], 1, 1000);
+  }
+  getrusage(RUSAGE_SELF, &after);
+
+  *mmaps = heap->stats.mmap_calls - calls;
+  *faults = after.ru_minflt - before.ru_minflt;
+
+  for(int i=0; i<RESERVE_TEST_COUNT; i++){
+    heap_free(heap, ptrs[i]);
+  }
+  return;
+}
+
+void wmalloc_reserve_test(){
+
+  void** ptrs = malloc(RESERVE_TEST_COUNT*sizeof(void*));
+  uint64_t plain_mmaps, reserved_mmaps;
+  long plain_faults, reserved_faults;
+
+  wmalloc_heap_t heap = heap_create();
+  reserve_burst(heap, ptrs, &plain_mmaps, &plain_faults);
+  heap_destroy(heap);
+
+  heap = heap_create();
+  //a heap in a span has its memory already
+  int reserved = heap_reserve(heap, RESERVE_TEST_COUNT*1100, WMALLOC_RESERVE_POPULATE);
+  if(reserved == -1){
+    printf("reserve: could not reserve\n");
+  }
+  expect(reserved != -1 || heap->span_capacity != 0, "heap_reserve");
+  reserve_burst(heap, ptrs, &reserved_mmaps, &reserved_faults);
+  heap_destroy(heap);
+
+  printf("reserve: burst made %lu mmap calls and %ld page faults, after reserving %lu and %ld\n",
+         plain_mmaps, plain_faults, reserved_mmaps, reserved_faults);
+  if(reserved != -1){
+    expect(reserved_mmaps == 0 && plain_mmaps > 0, "no mmap calls after reserving");
+    expect(reserved_faults < plain_faults, "fewer page faults after reserving");
+  }
+  free(ptrs);
+  return;
+}
+
+/*
+  Points the pressure watch at a made up cgroup, frees a burst while
+  the cgroup is far from its limit and then brings it close to the
+  limit, and looks at how much the default heap keeps mapped.
+*/
+void write_pressure_file(const char* dir, const char* name, const char* text){
+
+  char path[PRESSURE_PATH_LENGTH];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+  FILE* file = fopen(path, "w");
+  fputs(text, file);
+  fclose(file);
+  return;
+}
+
+void wmalloc_pressure_test(){
+
+  char dir[64];
+  snprintf(dir, sizeof(dir), "/tmp/wmalloc_pressure.%d", getpid());
+  mkdir(dir, 0700);
+  
+  write_pressure_file(dir, "memory.max", "1000000000\n");
+  write_pressure_file(dir, "memory.current", "500000000\n");
+  write_pressure_file(dir, "memory.pressure", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+
+  struct timespec pass = {0, 50000000};
+  
+  wmalloc_background_start(10, 1000000);
+  wmalloc_premap_start(4, 8, 0);
+  expect(wmalloc_pressure_watch(dir) != -1, "pressure watch started");
+
+  void** ptrs = malloc(RESERVE_TEST_COUNT*sizeof(void*));
+  for(int i=0; i<RESERVE_TEST_COUNT; i++){
+    ptrs[i] = wmalloc(1000);
+  }
+  for(int i=0; i<RESERVE_TEST_COUNT; i++){
+    wfree(ptrs[i]);
+  }
+  free(ptrs);
+  
+  nanosleep(&pass, NULL);
+  int low_level = wmalloc_memory_pressure();
+  uint64_t low_mapped = __atomic_load_n(&wmalloc_ptr->stats.mapped_bytes, __ATOMIC_RELAXED);
+
+  write_pressure_file(dir, "memory.current", "990000000\n");
+  nanosleep(&pass, NULL);
+  int high_level = wmalloc_memory_pressure();
+  uint64_t high_mapped = __atomic_load_n(&wmalloc_ptr->stats.mapped_bytes, __ATOMIC_RELAXED);
+
+  write_pressure_file(dir, "memory.current", "500000000\n");
+  write_pressure_file(dir, "memory.pressure", "some avg10=5.00 avg60=1.00 avg300=0.20 total=12345\n");
+  nanosleep(&pass, NULL);
+  int stall_level = wmalloc_memory_pressure();
+  
+  wmalloc_background_stop();
+
+  printf("pressure: at level %d %lu bytes mapped, at level %d %lu, stalls give level %d\n",
+         low_level, low_mapped, high_level, high_mapped, stall_level);
+  expect(low_level == 0 && high_level == 100 && stall_level == 50, "pressure levels");
+  //regions of a span stay mapped
+  expect(high_mapped < low_mapped || wmalloc_ptr->span_capacity != 0, "trimmed harder under pressure");
+
+  const char* names[] = {"memory.max", "memory.current", "memory.pressure"};
+  char path[PRESSURE_PATH_LENGTH];
+  for(int i=0; i<3; i++){
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    unlink(path);
+  }
+  rmdir(dir);
+  return;
+}
+
+/*
+  Fills a heap, frees most of the second half and a little of the
+  first, then moves every object the hint picks and trims.
+*/
+#define DEFRAG_TEST_COUNT 20000
+#define DEFRAG_TEST_SIZE 200
+
+void wmalloc_defrag_test(){
+
+  wmalloc_heap_t heap = heap_create();
+  void** ptrs = malloc(DEFRAG_TEST_COUNT*sizeof(void*));
+
+  for(int i=0; i<DEFRAG_TEST_COUNT; i++){
+    ptrs[i] = heap_alloc(heap, DEFRAG_TEST_SIZE);
+    memset(ptrs[i], i, DEFRAG_TEST_SIZE);
+  }
+  for(int i=0; i<DEFRAG_TEST_COUNT; i++){
+    int keep = (i < DEFRAG_TEST_COUNT/2) ? rand()%10 < 6 : rand()%10 < 1;
+    if(keep == 0){
+      heap_free(heap, ptrs[i]);
+      ptrs[i] = NULL;
+    }
+  }
+
+  heap_trim(heap, 0);
+  uint64_t before = heap->stats.mapped_bytes;
+
+  int moved = 0;
+  int intact = 1;
+  clock_t t = clock();
+  wmalloc_defrag_scan();
+  for(int i=0; i<DEFRAG_TEST_COUNT; i++){
+
+    if(ptrs[i] == NULL || heap_defrag_hint(heap, ptrs[i]) == 0){
+      continue;
+    }
+    void* new_ptr = heap_alloc(heap, DEFRAG_TEST_SIZE);
+    memcpy(new_ptr, ptrs[i], DEFRAG_TEST_SIZE);
+    heap_free(heap, ptrs[i]);
+    ptrs[i] = new_ptr;
+    moved++;
+  }
+  t = clock() - t;
+  for(int i=0; i<DEFRAG_TEST_COUNT; i++){
+    if(ptrs[i] != NULL && ((unsigned char*)ptrs[i])[DEFRAG_TEST_SIZE-1] != (unsigned char)i){
+      intact = 0;
+    }
+  }
+
+  heap_trim(heap, 0);
+  uint64_t after = heap->stats.mapped_bytes;
+
+  printf("defrag: moved %d objects in %f seconds, %lu bytes mapped before and %lu after, contents intact: %s\n",
+         moved, ((double)t)/CLOCKS_PER_SEC, before, after, intact ? "yes" : "no");
+  expect(moved > 0 && intact == 1, "defrag moved objects intact");
+  expect(after < before || heap->span_capacity != 0, "defrag gave regions back");
+
+  heap_destroy(heap);
+  free(ptrs);
+  return;
+}
+
+/*
+  Allocates through handles, frees most of them, pins a few and
+  compacts. Checks the contents moved along and the pinned
+  allocations stayed.
+*/
+#define HANDLE_TEST_COUNT 20000
+
+void wmalloc_handle_test(){
+
+  wm_handle* handles = malloc(HANDLE_TEST_COUNT*sizeof(wm_handle));
+  void* pinned[10];
+
+  for(int i=0; i<HANDLE_TEST_COUNT; i++){
+    uint64_t length = 16 + rand()%300;
+    handles[i] = wmalloc_h(length);
+    char* p = wmalloc_pin(handles[i]);
+    expect(((uint64_t)p & 15) == 0, "handle memory 16 byte aligned");
+    memset(p, i, length);
+    wmalloc_unpin(handles[i]);
+  }
+  for(int i=0; i<HANDLE_TEST_COUNT; i++){
+    if(rand()%10 < 8){
+      wfree_h(handles[i]);
+      handles[i] = 0;
+    }
+  }
+  int count = 0;
+  for(int i=HANDLE_TEST_COUNT-1; i>=0 && count<10; i--){
+    if(handles[i] != 0){
+      pinned[count] = wmalloc_pin(handles[i]);
+      count++;
+    }
+  }
+
+  //what the holes alone give back
+  uint64_t trimmed = heap_trim(wmalloc_handles.heap, 0);
+  
+  clock_t t = clock();
+  uint64_t compacted = wmalloc_compact();
+  t = clock() - t;
+
+  int intact = 1;
+  count = 0;
+  for(int i=HANDLE_TEST_COUNT-1; i>=0; i--){
+    if(handles[i] == 0){
+      continue;
+    }
+    unsigned char* p = wmalloc_pin(handles[i]);
+    if(p[0] != (unsigned char)i || p[15] != (unsigned char)i){
+      intact = 0;
+    }
+    if(count < 10){
+      if(p != pinned[count]){
+        intact = 0;
+      }
+      wmalloc_unpin(handles[i]);
+      count++;
+    }
+    wmalloc_unpin(handles[i]);
+    wfree_h(handles[i]);
+  }
+
+  printf("handles: trimming gave back %lu bytes, compacting %lu more in %f seconds, contents intact: %s\n",
+         trimmed, compacted, ((double)t)/CLOCKS_PER_SEC, intact ? "yes" : "no");
+  expect(intact == 1, "handle contents moved along and pins kept");
+  expect(compacted > 0, "compaction gave memory back");
+  free(handles);
+  return;
+}
+
+/*
+  Moves one allocation down over a freed neighbour, then frees the
+  allocation in front of it and allocates again. The chunk in front
+  must still see the moved one as in use.
+*/
+void wmalloc_handle_move_test(){
+
+  wm_handle handles[4];
+
+  for(int i=0; i<4; i++){
+    handles[i] = wmalloc_h(100);
+    memset(wmalloc_pin(handles[i]), 'A' + i, 100);
+    wmalloc_unpin(handles[i]);
+  }
+  wfree_h(handles[1]);
+  wmalloc_compact();
+  wfree_h(handles[0]);
+
+  wm_handle again = wmalloc_h(200);
+  memset(wmalloc_pin(again), 'E', 200);
+  wmalloc_unpin(again);
+
+  for(int i=2; i<4; i++){
+    char* p = wmalloc_pin(handles[i]);
+    expect(p[0] == 'A' + i && p[99] == 'A' + i, "moved handle contents kept");
+    wmalloc_unpin(handles[i]);
+    wfree_h(handles[i]);
+  }
+  wfree_h(again);
+
+  printf("handles: contents kept after freeing in front of a moved allocation \n");
+  return;
+}
+
+/*
+  Allocates many tiny objects on a heap of their own and reports the
+  bytes each one takes. Build with -DWMALLOC_COMPACT to compare the
+  compact chunk format.
+*/
+#define TINY_TEST_COUNT 100000
+
+void wmalloc_tiny_test(){
+
+  wmalloc_heap_t heap = heap_create();
+
+  clock_t t = clock();
+  for(int i=0; i<TINY_TEST_COUNT; i++){
+    uint64_t* p = heap_alloc(heap, 8);
+    *p = i;
+  }
+  t = clock() - t;
+
+  printf("tiny: %d objects of 8 bytes take %lu bytes each with a %d byte minimum chunk, %f seconds\n",
+         TINY_TEST_COUNT, heap->stats.in_use_bytes/TINY_TEST_COUNT, MINIMUM_CHUNK_SIZE,
+         ((double)t)/CLOCKS_PER_SEC);
+  expect(heap->stats.in_use_bytes/TINY_TEST_COUNT == MINIMUM_CHUNK_SIZE, "tiny objects take the minimum chunk");
+
+  heap_destroy(heap);
+  return;
+}
+
+/*
+  Builds the same tree of nodes with four children each from 64 bit
+  pointers with wmalloc and from 32 bit references in a cage, and
+  compares the bytes in use and the sums over both.
+*/
+#define CAGE_TEST_NODES 100000
+
+struct wide_node{
+
+  struct wide_node* child[4];
+  uint64_t value;
+};
+
+struct caged_node{
+
+  uint32_t child[4];
+  uint32_t value;
+};
+
+uint64_t wide_sum(struct wide_node* node){
+
+  if(node == NULL){
+    return 0;
+  }
+  uint64_t sum = node->value;
+  for(int i=0; i<4; i++){
+    sum = sum + wide_sum(node->child[i]);
+  }
+  return sum;
+}
+
+uint64_t caged_sum(wmalloc_heap_t cage, uint32_t ref){
+
+  struct caged_node* node = wmalloc_decompress(cage, ref);
+  if(node == NULL){
+    return 0;
+  }
+  uint64_t sum = node->value;
+  for(int i=0; i<4; i++){
+    sum = sum + caged_sum(cage, node->child[i]);
+  }
+  return sum;
+}
+
+void wmalloc_cage_test(){
+
+  wmalloc_heap_t wide = heap_create();
+  wmalloc_heap_t cage = wmalloc_cage_create();
+
+  struct wide_node** wide_nodes = malloc(CAGE_TEST_NODES*sizeof(void*));
+  uint32_t* caged_nodes = malloc(CAGE_TEST_NODES*sizeof(uint32_t));
+
+  //node i is the child of node (i-1)/4
+  for(int i=0; i<CAGE_TEST_NODES; i++){
+
+    wide_nodes[i] = heap_alloc(wide, sizeof(struct wide_node));
+    memset(wide_nodes[i], 0, sizeof(struct wide_node));
+    wide_nodes[i]->value = i;
+
+    struct caged_node* node = heap_alloc(cage, sizeof(struct caged_node));
+    memset(node, 0, sizeof(struct caged_node));
+    node->value = i;
+    caged_nodes[i] = wmalloc_compress(cage, node);
+
+    if(i > 0){
+      wide_nodes[(i-1)/4]->child[(i-1)%4] = wide_nodes[i];
+      struct caged_node* parent = wmalloc_decompress(cage, caged_nodes[(i-1)/4]);
+      parent->child[(i-1)%4] = caged_nodes[i];
+    }
+  }
+
+  uint64_t wide_sum_all = wide_sum(wide_nodes[0]);
+  uint64_t caged_sum_all = caged_sum(cage, caged_nodes[0]);
+
+  printf("cage: %d nodes take %lu bytes with pointers and %lu with 32 bit references, same sums: %s\n",
+         CAGE_TEST_NODES, wide->stats.in_use_bytes, cage->stats.in_use_bytes,
+         wide_sum_all == caged_sum_all ? "yes" : "no");
+  expect(wide_sum_all == caged_sum_all, "caged tree sums the same");
+  expect(cage->stats.in_use_bytes < wide->stats.in_use_bytes, "32 bit references take less");
+
+  heap_destroy(wide);
+  wmalloc_cage_destroy(cage);
+  free(wide_nodes);
+  free(caged_nodes);
+  return;
+}
+
+/*
+  Reads the first cache line of objects that each take a region of
+  their own, so that without colours they all fall into the same
+  cache sets, from a heap with uncoloured regions and one with
+  coloured regions. Counts the L1 data cache misses where the kernel
+  gives access to the counter.
+*/
+#define COLOUR_TEST_OBJECTS 128
+#define COLOUR_TEST_SIZE 70000
+#define COLOUR_TEST_PASSES 200000
+
+int open_l1_miss_counter(){
+
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+  Returns the seconds taken and sets 'misses' to the L1 misses, or -1
+*/
+double colour_pass(uint64_t colours, long* misses){
+
+  wmalloc_conf.colours = colours;
+  wmalloc_heap_t heap = heap_create();
+
+  volatile uint64_t* objects[COLOUR_TEST_OBJECTS];
+  for(int i=0; i<COLOUR_TEST_OBJECTS; i++){
+    objects[i] = heap_alloc(heap, COLOUR_TEST_SIZE);
+    objects[i][0] = i;
+  }
+
+  int fd = open_l1_miss_counter();
+  if(fd != -1){
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  uint64_t sum = 0;
+  clock_t t = clock();
+  for(int pass=0; pass<COLOUR_TEST_PASSES; pass++){
+    for(int i=0; i<COLOUR_TEST_OBJECTS; i++){
+      sum = sum + objects[i][0];
+    }
+  }
+  t = clock() - t;
+
+  *misses = -1;
+  if(fd != -1){
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(read(fd, misses, sizeof(long)) != sizeof(long)){
+      *misses = -1;
+    }
+    close(fd);
+  }
+
+  expect(sum == (uint64_t)COLOUR_TEST_PASSES*COLOUR_TEST_OBJECTS*(COLOUR_TEST_OBJECTS-1)/2,
+         "coloured objects read back");
+
+  heap_destroy(heap);
+  return ((double)t)/CLOCKS_PER_SEC;
+}
+
+void wmalloc_colour_test(){
+
+  uint64_t colours = wmalloc_conf.colours;
+  long plain_misses;
+  long coloured_misses;
+
+  double plain = colour_pass(0, &plain_misses);
+  double coloured = colour_pass(WMALLOC_COLOURS, &coloured_misses);
+  wmalloc_conf.colours = colours;
+
+  printf("colours: %d hot objects read in %f seconds uncoloured, %f with %d colours\n",
+         COLOUR_TEST_OBJECTS, plain, coloured, WMALLOC_COLOURS);
+  if(plain_misses == -1 || coloured_misses == -1){
+    printf("colours: L1 misses not counted, no access to the counter\n");
+  }
+  else{
+    printf("colours: %ld L1 misses uncoloured, %ld coloured\n", plain_misses, coloured_misses);
+  }
+  return;
+}
+
+/*
+  Runs wmalloc over a buffer in a child process and counts the system
+  calls the child makes while it allocates and frees, by tracing it.
+  The child stops itself around a stretch with no work and around the
+  work, and the difference is what wmalloc and wfree called.
+  Then fills the buffer twice to see it runs out at the same point.
+*/
+#define BUFFER_TEST_SIZE 0x1000000
+
+void buffer_work(void** slots, int operations){
+
+  for(int i=0; i<operations; i++){
+    int slot = rand()%1000;
+    if(slots[slot] != NULL){
+      wfree(slots[slot]);
+      slots[slot] = NULL;
+    }
+    else{
+      slots[slot] = wmalloc(rand()%4000);
+    }
+  }
+  return;
+}
+
+int buffer_fill(void** slots){
+
+  int count = 0;
+  while((slots[count] = wmalloc(1000)) != NULL){
+    count++;
+  }
+  if(errno != ENOMEM){
+    return -1;
+  }
+  for(int i=0; i<count; i++){
+    wfree(slots[i]);
+  }
+  return count;
+}
+
+/*
+  Let the traced child run to its next SIGSTOP, counting the system
+  call stops on the way. Returns -1 if the child exits.
+*/
+int count_syscall_stops(pid_t pid){
+
+  int stops = 0;
+  int status;
+  
+  while(1){
+
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    if(waitpid(pid, &status, 0) == -1 || WIFEXITED(status)){
+      return -1;
+    }
+    if(WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP|0x80)){
+      stops++;
+    }
+    else if(WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP){
+      return stops;
+    }
+  }
+}
+
+void wmalloc_buffer_test(){
+
+  int results[2];
+  if(pipe(results) == -1){
+    return;
+  }
+  
+  pid_t pid = fork();
+  if(pid == 0){
+
+    static char buffer[BUFFER_TEST_SIZE];
+    static void* slots[BUFFER_TEST_SIZE/1000];
+    
+    close(results[0]);
+    int counts[2] = {0, 0};
+    
+    if(wmalloc_init_with_buffer(buffer, BUFFER_TEST_SIZE) == -1 ||
+       ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1){
+      _exit(2);
+    }
+
+    //carve the regions and touch the pages first
+    buffer_work(slots, 100000);
+    
+    raise(SIGSTOP);
+    raise(SIGSTOP);
+    buffer_work(slots, 1000000);
+    raise(SIGSTOP);
+
+    buffer_work(slots, 0);
+    for(int i=0; i<1000; i++){
+      if(slots[i] != NULL){
+        wfree(slots[i]);
+        slots[i] = NULL;
+      }
+    }
+    counts[0] = buffer_fill(slots);
+    counts[1] = buffer_fill(slots);
+    
+    if(write(results[1], counts, sizeof(counts)) != sizeof(counts)){
+      _exit(1);
+    }
+    _exit(0);
+  }
+  close(results[1]);
+
+  int status;
+  waitpid(pid, &status, 0);
+
+  if(WIFEXITED(status)){
+    printf("buffer: could not trace the child, skipped \n");
+    close(results[0]);
+    return;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD|PTRACE_O_EXITKILL);
+
+  int idle = count_syscall_stops(pid);
+  int busy = count_syscall_stops(pid);
+  
+  ptrace(PTRACE_DETACH, pid, NULL, NULL);
+  
+  int counts[2] = {-1, -1};
+  if(read(results[0], counts, sizeof(counts)) != sizeof(counts)){
+    printf("buffer: the child did not finish \n");
+  }
+  close(results[0]);
+  waitpid(pid, &status, 0);
+
+  //each call stops on the way in and out
+  printf("buffer: %d system calls in 1000000 steady state operations, filled with %d and %d chunks \n",
+         (busy - idle)/2, counts[0], counts[1]);
+  expect(busy == idle, "no system calls over a buffer");
+  expect(counts[0] > 0 && counts[0] == counts[1], "the buffer runs out at the same point");
+  return;
+}
+
+/*
+  Starts a child on a buffer with the size classes set in
+  WMALLOC_CONF, which have to go to the heap in the buffer.
+*/
+void wmalloc_buffer_config_test(){
+
+  pid_t pid = fork();
+  if(pid == 0){
+
+    static char buffer[BUFFER_TEST_SIZE];
+    static void* slots[1000];
+
+    setenv("WMALLOC_CONF", "size_classes:256/16-4096/x2,region_size:64k", 1);
+    if(wmalloc_init_with_buffer(buffer, BUFFER_TEST_SIZE) == -1){
+      _exit(2);
+    }
+    //the default layout starts 8 bytes apart
+    if(wmalloc_ptr->bin_index[1] - wmalloc_ptr->bin_index[0] != 16){
+      _exit(3);
+    }
+    //the threshold follows the region size when it is not given
+    if(wmalloc_conf.mmap_threshold != 0x10000){
+      _exit(4);
+    }
+    for(int i=0; i<1000; i++){
+      slots[i] = wmalloc(16 + i*8);
+      memset(slots[i], i, 16 + i*8);
+    }
+    for(int i=0; i<1000; i++){
+      wfree(slots[i]);
+    }
+    _exit(0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+
+  printf("buffer config: size classes and region size from WMALLOC_CONF %s \n",
+         WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "applied" : "failed");
+  expect(WIFEXITED(status) && WEXITSTATUS(status) == 0, "WMALLOC_CONF applied in buffer mode");
+  return;
+}
+
+/*
+  A child publishes its counters and allocates, and the parent reads
+  them from the segment the way wmstat does.
+*/
+#define STATS_TEST_ALLOCS 1000
+#define STATS_TEST_FREES 400
+
+void wmalloc_stats_test(){
+
+  int ready[2];
+  int done[2];
+  if(pipe(ready) == -1 || pipe(done) == -1){
+    return;
+  }
+
+  //the child leaves through exit, which would write out a copy of
+  //what is still buffered
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0){
+
+    static void* slots[STATS_TEST_ALLOCS];
+    char c = 0;
+
+    close(ready[0]);
+    close(done[1]);
+    if(wmalloc_stats_publish() == -1){
+      _exit(2);
+    }
+    for(int i=0; i<STATS_TEST_ALLOCS; i++){
+      slots[i] = wmalloc(100);
+    }
+    for(int i=0; i<STATS_TEST_FREES; i++){
+      wfree(slots[i]);
+    }
+
+    //the segment goes when the child exits
+    if(write(ready[1], &c, 1) != 1 || read(done[0], &c, 1) != 1){
+      _exit(1);
+    }
+    exit(0);
+  }
+
+  close(ready[1]);
+  close(done[0]);
+  
+  char c = 0;
+  char name[32];
+  uint64_t allocs = 0;
+  uint64_t frees = 0;
+  uint64_t in_use = 0;
+  int found = 0;
+  
+  stats_segment_name(name, pid);
+
+  if(read(ready[0], &c, 1) == 1){
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd != -1){
+      struct wmalloc_info* heap = mmap(NULL, sizeof(struct wmalloc_info), PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+
+      if(heap != (void*) -1){
+        found = heap->magic == WMALLOC_STATS_MAGIC && heap->info_size == sizeof(struct wmalloc_info);
+        allocs = __atomic_load_n(&heap->stats.allocs, __ATOMIC_RELAXED);
+        frees = __atomic_load_n(&heap->stats.frees, __ATOMIC_RELAXED);
+        in_use = __atomic_load_n(&heap->stats.in_use_bytes, __ATOMIC_RELAXED);
+        munmap(heap, sizeof(struct wmalloc_info));
+      }
+    }
+    if(write(done[1], &c, 1) != 1){
+      kill(pid, SIGKILL);
+    }
+  }
+  close(ready[0]);
+  close(done[1]);
+  
+  int status;
+  waitpid(pid, &status, 0);
+
+  //a WMALLOC_COMPACT build has no stats segment
+  if(WIFEXITED(status) && WEXITSTATUS(status) == 2){
+    printf("stats: the counters could not be published, skipped \n");
+    return;
+  }
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd != -1){
+    close(fd);
+  }
+
+  printf("stats: segment %s, %lu allocs and %lu frees read back for %d and %d, %lu bytes in use, removed at exit: %s \n",
+         found ? "found" : "NOT found", allocs, frees, STATS_TEST_ALLOCS, STATS_TEST_FREES, in_use,
+         fd == -1 ? "yes" : "no");
+  expect(found == 1 && allocs == STATS_TEST_ALLOCS && frees == STATS_TEST_FREES, "published counters read back");
+  expect(in_use > 0 && fd == -1, "stats segment removed at exit");
+  return;
+}
+
+int main(){
+
+  srand(time(NULL));
+ 
+  clock_t t;
+  double time_taken;
+
+  //before anything else uses wmalloc, the child starts on a buffer
+  wmalloc_buffer_test();
+  wmalloc_buffer_config_test();
+  wmalloc_stats_test();
+   
+  t = clock(); 
+  wmalloc_test1(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_test1() took %f seconds to execute \n", time_taken);
+
+  uint64_t released = wmalloc_trim(0);
+  printf("wmalloc_trim(0) released %lu bytes, %lu bytes left in bins \n",
+         released, calc_mem_available());
+  expect(released > 0, "wmalloc_trim released memory");
+
+  wmalloc_policy_test();
+
+  t = clock(); 
+  std_test1(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("std_test1() took %f seconds to execute \n", time_taken);
+
+  t = clock(); 
+  wmalloc_test2(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_test2() took %f seconds to execute \n", time_taken);
+
+  t = clock(); 
+  std_test2(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("std_test2() took %f seconds to execute \n", time_taken);
+
+  wmalloc_background_start(10, 100);
+  
+  t = clock(); 
+  wmalloc_test1(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_test1() with background thread took %f seconds to execute \n", time_taken);
+
+  wmalloc_premap_start(4, 16, WMALLOC_PREMAP_POPULATE);
+  
+  t = clock(); 
+  wmalloc_test2(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_test2() with premapped regions took %f seconds to execute \n", time_taken);
+
+  wmalloc_background_stop();
+
+  wmalloc_learn_test();
+
+  t = clock(); 
+  wmalloc_heap_test(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_heap_test() took %f seconds to execute \n", time_taken);
+
+  wmalloc_purge_test();
+
+  wmalloc_pheap_test();
+
+  t = clock(); 
+  wmalloc_shared_test(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_shared_test() took %f seconds to execute \n", time_taken);
+
+  wmalloc_hooks_test();
+  wmalloc_tags_test();
+  wmalloc_dump_test();
+  wmalloc_retire_test();
+  wmalloc_scratch_test();
+  wmalloc_reserve_test();
+  wmalloc_pressure_test();
+  wmalloc_defrag_test();
+  wmalloc_handle_test();
+  wmalloc_handle_move_test();
+  wmalloc_tiny_test();
+  wmalloc_cage_test();
+  wmalloc_colour_test();
+
+  //from here on wmalloc uses the arenas
+  t = clock(); 
+  wmalloc_arena_test(); 
+  t = clock() - t; 
+  time_taken = ((double)t)/CLOCKS_PER_SEC; // in seconds 
+  
+  printf("wmalloc_arena_test() took %f seconds to execute \n", time_taken);
   
   return 0;
 }
@@ -0,0 +1,249 @@
+/*
+  wmheap - analyse a heap dump written by wmalloc_dump_heap
+
+  Usage: wmheap [-m] dumpfile
+
+  Prints the regions and bytes in use and available, how fragmented
+  the available space is and a histogram of the sizes of the
+  available chunks, for the default heap and then each arena. With -m each region gets a line showing where
+  its chunks in use ('#'), available ('.') and mixed ('+') are, and
+  purged pages (' ').
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wmalloc.h"
+
+//characters in a line of the region map
+#define MAP_WIDTH 64
+
+//histogram buckets, one per power of two
+#define SIZE_BUCKETS 48
+
+/*
+  Read the next word of the dump. Returns 0 at the end of the file.
+*/
+int read_word(FILE* file, uint64_t* word){
+
+  return fread(word, sizeof(uint64_t), 1, file) == 1;
+}
+
+/*
+  Mark the part of the region map that the chunk at 'offset' covers.
+  Each character starts as 0 and collects a bit for each state seen.
+*/
+void map_chunk(char* map, uint64_t region_length, uint64_t offset, uint64_t size, int state){
+
+  uint64_t first = offset*MAP_WIDTH/region_length;
+  uint64_t last = (offset + size - 1)*MAP_WIDTH/region_length;
+
+  for(uint64_t i=first; i<=last && i<MAP_WIDTH; i++){
+    map[i] = map[i] | state;
+  }
+  return;
+}
+
+/*
+  Print the map of a region
+*/
+void print_map(char* map, uint64_t start, uint64_t length){
+
+  printf("%016lx %10lu |", start, length);
+  for(int i=0; i<MAP_WIDTH; i++){
+    switch(map[i]){
+    case 1:
+      printf("#");
+      break;
+    case 2:
+      printf(".");
+      break;
+    case 4:
+      printf(" ");
+      break;
+    default:
+      printf("+");
+    }
+  }
+  printf("|\n");
+
+  return;
+}
+
+/*
+  Read the dump of one heap from 'file' and print what it holds.
+  Returns 0 if no further dump follows and -1 if it is damaged.
+*/
+int analyse_heap(FILE* file, int show_map){
+
+  uint64_t word;
+  uint64_t heap;
+  uint64_t num_bins;
+
+  if(read_word(file, &word) == 0){
+    return 0;
+  }
+  if(word != WMALLOC_DUMP_MAGIC || read_word(file, &heap) == 0
+     || read_word(file, &num_bins) == 0 || num_bins > NUM_BINS){
+    return 0;
+  }
+  for(uint64_t i=0; i<num_bins; i++){
+    read_word(file, &word);
+  }
+
+  uint64_t regions = 0;
+  uint64_t mapped = 0;
+  uint64_t chunks_in_use = 0;
+  uint64_t bytes_in_use = 0;
+  uint64_t chunks_free = 0;
+  uint64_t bytes_free = 0;
+  uint64_t bytes_purged = 0;
+  uint64_t largest_free = 0;
+  uint64_t histogram[SIZE_BUCKETS];
+  memset(histogram, 0, sizeof(histogram));
+
+  int complete = 0;
+  char map[MAP_WIDTH];
+  uint64_t region_start = 0;
+  uint64_t region_length = 0;
+  uint64_t offset = 0;
+
+  if(show_map == 1){
+    printf("%16s %10s  %s\n", "region", "length", "# in use  . available  + both  ' ' purged");
+  }
+
+  while(read_word(file, &word) == 1){
+
+    if(word == DUMP_END || (word & 0xff00000000000000) == DUMP_REGION){
+
+      if(show_map == 1 && regions > 0){
+        print_map(map, region_start, region_length);
+      }
+      if(word == DUMP_END){
+        complete = 1;
+        break;
+      }
+
+      uint64_t kind = word & 0xff;
+      uint64_t colour = (word >> 8) & 0xffff;
+      read_word(file, &region_start);
+      read_word(file, &region_length);
+
+      regions++;
+      mapped = mapped + region_length;
+      memset(map, 0, MAP_WIDTH);
+
+      //the chunks follow the colour and the region header, if there is one
+      offset = colour + ((kind == DUMP_REGION_SMALL) ? 0 : sizeof(struct region));
+      continue;
+    }
+
+    uint64_t size = word & SIZE_MASK;
+    if(size == 0 || region_length == 0){
+      printf("wmheap: the dump is damaged\n");
+      return -1;
+    }
+
+    int state;
+    if((word & IN_USE_FLAG) != 0){
+      chunks_in_use++;
+      bytes_in_use = bytes_in_use + size;
+      state = 1;
+    }
+    else{
+      chunks_free++;
+      bytes_free = bytes_free + size;
+      if(size > largest_free){
+        largest_free = size;
+      }
+
+      int bucket = 63 - __builtin_clzl(size);
+      histogram[bucket < SIZE_BUCKETS ? bucket : SIZE_BUCKETS-1]++;
+
+      if((word & PURGED_FLAG) != 0){
+        bytes_purged = bytes_purged + size;
+        state = 4;
+      }
+      else{
+        state = 2;
+      }
+    }
+
+    map_chunk(map, region_length, offset, size, state);
+    offset = offset + size;
+  }
+
+  if(complete == 0){
+    printf("wmheap: the dump ends early\n");
+  }
+
+  printf("\nheap %lx: %lu regions, %lu bytes mapped\n", heap, regions, mapped);
+  printf("in use:    %10lu chunks %14lu bytes\n", chunks_in_use, bytes_in_use);
+  printf("available: %10lu chunks %14lu bytes, %lu purged\n", chunks_free, bytes_free, bytes_purged);
+
+  //1 when no request for more than the largest chunk can be met
+  //however much is available in total
+  if(bytes_free > 0){
+    printf("largest available chunk %lu bytes, fragmentation %.3f\n",
+           largest_free, 1.0 - (double)largest_free/bytes_free);
+  }
+
+  uint64_t most = 1;
+  for(int i=0; i<SIZE_BUCKETS; i++){
+    if(histogram[i] > most){
+      most = histogram[i];
+    }
+  }
+
+  printf("\nsizes of available chunks\n");
+  for(int i=0; i<SIZE_BUCKETS; i++){
+    if(histogram[i] == 0){
+      continue;
+    }
+    printf("%12lu - %-12lu %8lu ", 1UL << i, (2UL << i) - 1, histogram[i]);
+    for(uint64_t j=0; j < histogram[i]*50/most; j++){
+      printf("*");
+    }
+    printf("\n");
+  }
+
+  return 1;
+}
+
+int main(int argc, char** argv){
+
+  int show_map = 0;
+  int arg = 1;
+
+  if(arg < argc && strcmp(argv[arg], "-m") == 0){
+    show_map = 1;
+    arg++;
+  }
+  if(arg >= argc){
+    printf("usage: wmheap [-m] dumpfile\n");
+    return 1;
+  }
+
+  FILE* file = fopen(argv[arg], "rb");
+  if(file == NULL){
+    printf("wmheap: cannot open %s\n", argv[arg]);
+    return 1;
+  }
+
+  //the default heap and then each arena
+  int heaps = 0;
+  int result;
+  while((result = analyse_heap(file, show_map)) == 1){
+    heaps++;
+  }
+  fclose(file);
+
+  if(result == -1){
+    return 1;
+  }
+  if(heaps == 0){
+    printf("wmheap: %s is not a heap dump\n", argv[arg]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+  wmstat - watch the counters of a program using wmalloc
+
+  The program has to publish its counters, by running it with
+  WMALLOC_CONF="stats:1" or calling wmalloc_stats_publish.
+
+  Usage: wmstat [-b] pid [interval_ms [count]]
+
+  Prints the bytes mapped and in use and the rates per second of
+  allocations, frees, bin misses, new regions and mmap calls since
+  the last line. -b adds the available chunks in each bin.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "wmalloc.h"
+
+/*
+  Read a counter the allocator updates without a lock
+*/
+uint64_t counter(uint64_t* c){
+
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/*
+  Prints the column names
+*/
+void print_header(struct wmalloc_info* heap, int bins){
+
+  printf("%12s %12s %10s %10s %10s %10s %10s",
+         "mapped", "in_use", "allocs/s", "frees/s", "misses/s", "regions/s", "mmaps/s");
+
+  if(bins == 1){
+    for(int i=0; i<heap->num_bins; i++){
+      if(heap->bin_index[i] == 0xffffffffffffffff){
+        printf(" %8s", "rest");
+      }
+      else{
+        printf(" %8lu", heap->bin_index[i]);
+      }
+    }
+  }
+  printf("\n");
+
+  return;
+}
+
+int main(int argc, char** argv){
+
+  int bins = 0;
+  int arg = 1;
+
+  if(arg < argc && strcmp(argv[arg], "-b") == 0){
+    bins = 1;
+    arg++;
+  }
+  if(arg >= argc){
+    printf("usage: wmstat [-b] pid [interval_ms [count]]\n");
+    return 1;
+  }
+
+  int pid = atoi(argv[arg]);
+  long interval = 1000;
+  long count = -1;
+  if(arg+1 < argc){
+    interval = atol(argv[arg+1]);
+  }
+  if(arg+2 < argc){
+    count = atol(argv[arg+2]);
+  }
+  if(interval <= 0){
+    interval = 1000;
+  }
+
+  char name[32];
+  stats_segment_name(name, pid);
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if(fd == -1){
+    printf("wmstat: no counters published by %d\n", pid);
+    return 1;
+  }
+
+  struct wmalloc_info* heap = mmap(NULL, sizeof(struct wmalloc_info), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(heap == (void*) -1
+     || __atomic_load_n(&heap->magic, __ATOMIC_ACQUIRE) != WMALLOC_STATS_MAGIC
+     || heap->info_size != sizeof(struct wmalloc_info)){
+    printf("wmstat: %s was not published by this version of wmalloc\n", name);
+    return 1;
+  }
+
+  print_header(heap, bins);
+
+  struct wmalloc_stats last;
+  memset(&last, 0, sizeof(struct wmalloc_stats));
+
+  struct timespec wait;
+  wait.tv_sec = interval/1000;
+  wait.tv_nsec = (interval%1000)*1000000;
+
+  //the first line shows the totals so far
+  double seconds = 0;
+  struct timespec then;
+  clock_gettime(CLOCK_MONOTONIC, &then);
+
+  for(long n=0; n != count; n++){
+
+    struct wmalloc_stats now;
+    now.mapped_bytes = counter(&heap->stats.mapped_bytes);
+    now.mmap_calls = counter(&heap->stats.mmap_calls);
+    now.in_use_bytes = counter(&heap->stats.in_use_bytes);
+    now.allocs = counter(&heap->stats.allocs);
+    now.frees = counter(&heap->stats.frees);
+    now.bin_misses = counter(&heap->stats.bin_misses);
+    now.region_allocs = counter(&heap->stats.region_allocs);
+
+    if(seconds == 0){
+      seconds = 1;
+    }
+
+    printf("%12lu %12lu %10.0f %10.0f %10.0f %10.0f %10.0f",
+           now.mapped_bytes, now.in_use_bytes,
+           (now.allocs - last.allocs)/seconds,
+           (now.frees - last.frees)/seconds,
+           (now.bin_misses - last.bin_misses)/seconds,
+           (now.region_allocs - last.region_allocs)/seconds,
+           (now.mmap_calls - last.mmap_calls)/seconds);
+
+    if(bins == 1){
+      for(int i=0; i<heap->num_bins; i++){
+        printf(" %8lu", counter(&heap->stats.bin_chunks[i]));
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+
+    last = now;
+
+    if(n+1 == count){
+      break;
+    }
+
+    nanosleep(&wait, NULL);
+
+    //the program exited and removed its segment
+    if(kill(pid, 0) == -1){
+      break;
+    }
+
+    struct timespec time_now;
+    clock_gettime(CLOCK_MONOTONIC, &time_now);
+    seconds = (time_now.tv_sec - then.tv_sec) + (time_now.tv_nsec - then.tv_nsec)/1e9;
+    then = time_now;
+  }
+
+  munmap(heap, sizeof(struct wmalloc_info));
+
+  return 0;
+}